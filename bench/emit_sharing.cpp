@@ -0,0 +1,85 @@
+// Emits per second by name from 1 to N threads onto one event with an empty function, against a baseline that looks the
+// event up in a std::map under a shared_mutex, as emits did before they searched EventLookup. Emits write nothing shared
+// and scale with the number of cores; every baseline lookup writes the mutex, whose line then moves from core to core.
+// Run it under `perf stat -e cache-misses` to see the invalidations directly.
+//
+//     g++ -std=c++17 -O2 -pthread -I.. emit_sharing.cpp -o emit_sharing && ./emit_sharing [threads] [milliseconds]
+
+#include "event_manager.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+// Run body on each of threads threads for the given time and return the total number of iterations per second.
+template <typename Body>
+double measure(size_t threads, std::chrono::milliseconds duration, const Body &body)
+{
+    std::atomic<bool> start{false};
+    std::atomic<bool> stop{false};
+    std::vector<uint64_t> counts(threads * 8, 0);
+    std::vector<std::thread> workers;
+    for (size_t thread = 0; thread < threads; ++thread)
+    {
+        workers.emplace_back([&, thread]()
+                             {
+                                 uint64_t count = 0;
+                                 while (!start.load(std::memory_order_acquire))
+                                 {
+                                 }
+                                 while (!stop.load(std::memory_order_relaxed))
+                                 {
+                                     body();
+                                     ++count;
+                                 }
+                                 // Counts are 64 bytes apart, so storing them does not disturb the other threads.
+                                 counts[thread * 8] = count; });
+    }
+    auto begin = std::chrono::steady_clock::now();
+    start.store(true, std::memory_order_release);
+    std::this_thread::sleep_for(duration);
+    stop.store(true, std::memory_order_relaxed);
+    for (std::thread &worker : workers)
+        worker.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    uint64_t total = 0;
+    for (size_t thread = 0; thread < threads; ++thread)
+        total += counts[thread * 8];
+    return total / seconds;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    size_t maxThreads = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : std::thread::hardware_concurrency();
+    std::chrono::milliseconds duration(argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 500);
+
+    EventManager &eventManager = EventManager::getInstance();
+    eventManager.on<int>("tick", [](int) {});
+    const std::string eventName = "tick";
+
+    std::map<std::string, int> baselineMap{{"tick", 0}};
+    std::shared_mutex baselineMutex;
+
+    std::printf("%8s %16s %16s\n", "threads", "emits/s", "baseline/s");
+    for (size_t threads = 1; threads <= std::max<size_t>(maxThreads, 1); threads *= 2)
+    {
+        double emits = measure(threads, duration, [&]()
+                               { eventManager.emitEvent<int>(eventName, 1); });
+        double baseline = measure(threads, duration, [&]()
+                                  {
+                                      std::shared_lock<std::shared_mutex> lock(baselineMutex);
+                                      volatile int found = baselineMap.find(eventName)->second;
+                                      (void)found; });
+        std::printf("%8zu %16.0f %16.0f\n", threads, emits, baseline);
+    }
+    return 0;
+}
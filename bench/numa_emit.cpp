@@ -0,0 +1,131 @@
+// Emits per second from 1 to N threads onto one event with several functions, with setNumaReplication() off and on.
+// Threads are spread round-robin over the NUMA nodes and pinned to the CPUs of their node, so that with replication on
+// each thread reads the function table of its own node, and with it off every node reads the one table the registering
+// thread allocated. On a single-node host both columns should match; the difference shows on hosts with several nodes,
+// and grows when the shared table is bound to one node:
+//
+//     g++ -std=c++17 -O2 -pthread -I.. numa_emit.cpp -o numa_emit && ./numa_emit [threads] [milliseconds]
+//     numactl --cpunodebind=0,1 --membind=0 ./numa_emit 16 1000
+
+#include "event_manager.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sched.h>
+
+namespace
+{
+
+// CPUs of each NUMA node that this process may run on, read from /sys/devices/system/node/nodeN/cpulist. Nodes left
+// without CPUs by numactl --cpunodebind are dropped; a host without sysfs nodes is one node of all allowed CPUs.
+std::vector<cpu_set_t> nodeCpus()
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    ::sched_getaffinity(0, sizeof(allowed), &allowed);
+    std::vector<cpu_set_t> nodes;
+    for (unsigned node = 0; node < 64; ++node)
+    {
+        char path[64];
+        std::snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+        FILE *file = std::fopen(path, "r");
+        if (file == nullptr)
+            continue;
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        unsigned first, last;
+        while (std::fscanf(file, "%u", &first) == 1)
+        {
+            last = first;
+            if (std::fscanf(file, "-%u", &last) != 1)
+                last = first;
+            for (unsigned cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+            {
+                if (CPU_ISSET(cpu, &allowed))
+                    CPU_SET(cpu, &cpus);
+            }
+            if (std::fgetc(file) != ',')
+                break;
+        }
+        std::fclose(file);
+        if (CPU_COUNT(&cpus) > 0)
+            nodes.push_back(cpus);
+    }
+    if (nodes.empty())
+        nodes.push_back(allowed);
+    return nodes;
+}
+
+// Run body on each of threads threads, thread i pinned to node i % nodes.size(), for the given time and return the total
+// number of iterations per second.
+template <typename Body>
+double measure(size_t threads, const std::vector<cpu_set_t> &nodes, std::chrono::milliseconds duration, const Body &body)
+{
+    std::atomic<bool> start{false};
+    std::atomic<bool> stop{false};
+    std::vector<uint64_t> counts(threads * 8, 0);
+    std::vector<std::thread> workers;
+    for (size_t thread = 0; thread < threads; ++thread)
+    {
+        workers.emplace_back([&, thread]()
+                             {
+                                 const cpu_set_t &cpus = nodes[thread % nodes.size()];
+                                 ::sched_setaffinity(0, sizeof(cpus), &cpus);
+                                 uint64_t count = 0;
+                                 while (!start.load(std::memory_order_acquire))
+                                 {
+                                 }
+                                 while (!stop.load(std::memory_order_relaxed))
+                                 {
+                                     body();
+                                     ++count;
+                                 }
+                                 // Counts are 64 bytes apart, so storing them does not disturb the other threads.
+                                 counts[thread * 8] = count; });
+    }
+    auto begin = std::chrono::steady_clock::now();
+    start.store(true, std::memory_order_release);
+    std::this_thread::sleep_for(duration);
+    stop.store(true, std::memory_order_relaxed);
+    for (std::thread &worker : workers)
+        worker.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    uint64_t total = 0;
+    for (size_t thread = 0; thread < threads; ++thread)
+        total += counts[thread * 8];
+    return total / seconds;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    size_t maxThreads = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : std::thread::hardware_concurrency();
+    std::chrono::milliseconds duration(argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 500);
+
+    std::vector<cpu_set_t> nodes = nodeCpus();
+    std::printf("%zu NUMA nodes in use, EventManager::numaNodeCount() = %zu\n", nodes.size(),
+                EventManager::numaNodeCount());
+
+    EventManager &eventManager = EventManager::getInstance();
+    for (int function = 0; function < 8; ++function)
+        eventManager.on<int>("tick", [](int) {});
+    const std::string eventName = "tick";
+
+    std::printf("%8s %16s %16s\n", "threads", "shared/s", "replicated/s");
+    for (size_t threads = 1; threads <= std::max<size_t>(maxThreads, 1); threads *= 2)
+    {
+        eventManager.setNumaReplication(false);
+        double shared = measure(threads, nodes, duration, [&]()
+                                { eventManager.emitEvent<int>(eventName, 1); });
+        eventManager.setNumaReplication(true);
+        double replicated = measure(threads, nodes, duration, [&]()
+                                    { eventManager.emitEvent<int>(eventName, 1); });
+        std::printf("%8zu %16.0f %16.0f\n", threads, shared, replicated);
+    }
+    return 0;
+}
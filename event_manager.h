@@ -3,6 +3,7 @@
 // The EventManager class allows you to register functions or lambda functions to event names,
 // and emit these events, executing all registered functions for a given event.
 // The functions in each vector can have different signatures but the functions in the same function vector must have the same signature.
+// One event name can have several function vectors, one per signature.
 //
 // Example usage:
 //     EventManager event_manager;
@@ -18,135 +19,3741 @@
 //  The on() method returns a size_t value that can be used to unregister the function from the event using the off() method like this:
 //      size_t function_id = event_manager.on<int>("my_event", [](int value) { std::cout << "Received value: " << value << std::endl; });
 //      event_manager.off("my_event", function_id);
+//
+//  on() and off() may be called from any thread while others emit. Registering on an event that already exists takes
+//  no lock: the function goes into a slot of the event's table claimed with one atomic increment, and waits at most for
+//  registrations that claimed earlier slots to fill them, while emits never wait for registrations. Growing a full
+//  table, off() and registering while interceptors are installed take the event's own lock under a shared registry
+//  lock. Creating or reclaiming an event, and registering with an EventOwner, take the registry lock exclusively. An
+//  emit calls every function whose on() returned before it started and whose off() had not started before it ended, at
+//  most once; tests/registration_stress.cpp checks this under mixed on(), once(), off() and emits.
+//
+//  subscribe() returns a move-only Subscription token instead, which unregisters the function when it is destroyed.
+//  onWeak() ties a function to an object owned by a std::shared_ptr; each call holds a reference to the object, so it
+//  may be destroyed on any thread, and once it is gone the function is skipped and removed on the next emit:
+//      Subscription subscription = event_manager.subscribe<int>("my_event", [](int value) { ... });
+//      event_manager.onWeak<int>("my_event", mixer, [](Mixer &mixer, int value) { mixer.setVolume(value); });
+//
+//  Functions registered with an EventOwner are unregistered together by offAll() or when the owner is destroyed, in time
+//  proportional to the number of functions that owner registered:
+//      EventOwner session_owner;
+//      event_manager.on<int>(session_owner, "my_event", [](int value) { ... });
+//      event_manager.offAll(session_owner);
+//
+//  once() registers a function that is unregistered by the emit that first calls it:
+//      event_manager.once<int>("ack", [](int request_id) { ... });
+//
+//  onSampled() registers a function that is called for only a sample of the emits, every Nth or each with probability
+//  1/N, for diagnostics that do not need every event. Emits that are not sampled skip the call entirely:
+//      event_manager.onSampled<int>("meter_levels", SamplingMode::EveryNth, 100, [](int level) { ... });
+//
+//  Argument types are normalized, so on<int>, on<const int &> and emitEvent<int> all share one function vector. Events
+//  are keyed by name and signature, so functions with different signatures can share a name; an emit calls only the
+//  functions whose signature matches its argument types:
+//      event_manager.on<int>("volume", [](int volume_db) { ... });
+//      event_manager.on<const std::string &, int>("volume", [](const std::string &channel_type, int volume_db) { ... });
+//      event_manager.emitEvent<int>("volume", -6);   // Calls only the first function.
+//
+//  An emit by name that finds functions under its name but none with its argument types calls nothing, which is almost
+//  always a mistyped argument, so debug builds assert on it. An event whose functions of that signature are registered
+//  later can be resolved with handle() first. setStrictSignatures(true) allows one signature per name instead:
+//  registering a function or resolving a handle with another signature than the name already has throws
+//  std::invalid_argument.
+//
+//  Function IDs are unique across signatures, so off() needs only the name and the ID. An EventHandle resolves the name
+//  and signature once, and emits through it skip the lookup entirely:
+//      EventHandle<int> my_event = event_manager.handle<int>("my_event");
+//      event_manager.emitEvent(my_event, 42);
+//
+//  Functions are called in the order they were registered. Functions registered with non-const reference arguments
+//  form a chain over a payload owned by the caller: emitInPlace() passes the caller's objects by reference, without
+//  copying them, and each function sees the changes made by the ones before it:
+//      event_manager.on<AudioBlock &>("process", [](AudioBlock &block) { applyGain(block); });
+//      event_manager.on<AudioBlock &>("process", [](AudioBlock &block) { applyLimiter(block); });
+//      event_manager.emitInPlace("process", block);
+//
+//  Interceptors wrap every call of the functions they apply to, for logging, checks or metrics. The interceptors that
+//  apply to a function are flattened into one array when it is registered, which each call walks, and functions
+//  without interceptors are dispatched exactly as before. Interceptors therefore apply only to functions registered
+//  after they were added; functions registered before keep being called without them. An interceptor that does not
+//  call proceed() suppresses the call:
+//      event_manager.addInterceptor([](const InterceptedCall &call) { auto start = now(); call.proceed(); record(call.eventName, now() - start); });
+//      event_manager.addInterceptor("set_volume", [](const InterceptedCall &call) { if (authorized()) call.proceed(); });
+//
+//  setHandlerProfiling() makes emits read the hardware performance counters of the calling thread around each function
+//  call (cycles, instructions, cache misses and branch misses, via perf_event_open on Linux). The counts are summed per
+//  function, which shows a function that is cache-hostile rather than just slow. Emits pay nothing extra while it is off:
+//      event_manager.setHandlerProfiling(true);
+//      ...
+//      std::cout << event_manager.handlerProfileReport();
+//
+//  setSlowHandlerPolicy() times every function call and keeps a moving average per function. A function whose average
+//  exceeds the budget is reported once through a callback and counted, and can be moved off the emitting thread to a
+//  small worker pool, so that one slow logging function does not delay every emitter:
+//      SlowHandlerPolicy policy;
+//      policy.budget = std::chrono::microseconds(50);
+//      policy.offload = true;
+//      policy.onSlowHandler = [](const std::string &event_name, size_t function_id, std::chrono::nanoseconds average) { ... };
+//      event_manager.setSlowHandlerPolicy(policy);
+//
+//  setHeavyHitterTracking() counts emits per event name and calls per function in a count-min sketch of fixed size, and
+//  keeps the most frequent ones, so that the events flooding the bus can be found among any number of dynamic names:
+//      event_manager.setHeavyHitterTracking(true);
+//      for (const HeavyHitter &event : event_manager.topEvents(50)) { ... }
+//
+//  On hosts with several NUMA nodes, setNumaReplication() gives each node its own copy of every function table, built
+//  by the first emit that runs there so that its memory is local to that node. A copy holds, next to each entry, the
+//  flags emits check before calling it (tombstone, once, onWeak and sampling rate), so emits on a node read the shared
+//  entries only of the functions they actually call. The registered functions themselves are shared, since copying
+//  them would split their captured state.
+//
+//  An event whose last function is unregistered is removed from the registry, and sparse function vectors are shrunk.
+//  Tables, functions and events that emits on other threads may still be reading are retired and freed in batches once
+//  every such emit has finished, so off() never waits for emits. compact() forces all of this for every event, and
+//  memoryUsage() reports what the registry holds. listEvents(),
+//  handlerCount() and totalHandlers() describe the registry from counters kept up to date by on() and off(), without
+//  contending with registration or emits:
+//      for (const EventInfo &event : event_manager.listEvents()) { ... event.name, event.signature, event.functions ... }
+//
+//  Threads that emit many small events can buffer them instead. emitBuffered() appends to a buffer of the calling
+//  thread, which is emitted in one batch, in order, when it fills or its oldest event reaches a delay, or on flush(). A
+//  batch looks up each run of events with the same name once. A background thread flushes the buffers whose oldest
+//  event reached the delay, so that the events of threads that stopped emitting are not held back; it sleeps while every
+//  buffer is empty. It also emits what exiting threads left in their buffers. flushAll() flushes every buffer at once. A
+//  buffer is flushed by one thread at a time, so the events of each thread are emitted in order whichever thread
+//  flushes them:
+//      event_manager.setEmitBufferPolicy({256, std::chrono::milliseconds(5)});
+//      event_manager.emitBuffered<std::string>("log", line);
+//
+//  Events can also be queued and dispatched later from the thread that owns the main loop. On Linux the pending state is
+//  exposed as an eventfd that can be waited on with epoll alongside sockets and timers:
+//      event_manager.enqueueEvent<int>("my_event", 42);
+//      int fd = event_manager.pendingEventFd();   // Add to epoll with EPOLLIN.
+//      ...                                        // When fd becomes readable:
+//      event_manager.dispatchPending();
+//
+//  A dedicated consumer thread can instead block in waitAndDispatch(), which spins briefly, then yields, then parks until
+//  events are queued. setWaitStrategy() selects busy polling for latency-critical cores or pure blocking to save power.
+//
+//  Queued events are dispatched by priority, highest first. When the queue backs up, setSheddingPolicy() drops the oldest
+//  low-priority events first, and conflated events keep only their latest pending instance:
+//      event_manager.setEventPriority("meter_levels", EventPriority::Low);
+//      event_manager.setEventConflation("meter_levels", true);
+//      event_manager.setSheddingPolicy({10000, std::chrono::milliseconds(100), EventPriority::High});
+//
+//  A queued event can carry a deadline, after which it is discarded instead of dispatched. setDeadlineOrdering(true)
+//  dispatches the pending events of each priority earliest deadline first:
+//      event_manager.enqueueEventUntil<double>(std::chrono::steady_clock::now() + std::chrono::milliseconds(200), "seek", 12.5);
 
 #ifndef EVENT_MANAGER_H
 #define EVENT_MANAGER_H
 
+#include <algorithm>
 #include <functional>
 #include <vector>
 #include <map>
 #include <memory>
+#include <stdexcept>
 #include <string>
 #include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <deque>
+#include <iterator>
+#include <limits>
+#include <unordered_map>
+#include <thread>
+#include <typeinfo>
+#include <type_traits>
+#include <typeindex>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+#include <condition_variable>
+#include <tuple>
+#include <utility>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 // Define a template alias for std::function with variadic template arguments.
 template <typename... Args>
 using FunctionType = std::function<void(Args...)>;
 
-// Define a template alias for a pair of a unique identifier (size_t) and a FunctionType.
+// Maps every way of spelling an argument type to the one functions are stored with: T, const T, const T & and T && are
+// all passed as const T &. Non-const lvalue references are kept, since the function may write through them.
+template <typename T>
+struct NormalizeArgument
+{
+    using type = const typename std::decay<T>::type &;
+};
+
+template <typename T>
+struct NormalizeArgument<T &>
+{
+    using type = T &;
+};
+
+template <typename T>
+struct NormalizeArgument<const T &>
+{
+    using type = const typename std::decay<T>::type &;
+};
+
+template <typename T>
+using NormalizedArgument = typename NormalizeArgument<T>::type;
+
 template <typename... Args>
-using FunctionIdPair = std::pair<size_t, FunctionType<Args...>>;
+using NormalizedFunctionType = FunctionType<NormalizedArgument<Args>...>;
 
-// Define a template alias for a vector of FunctionIdPair with variadic template arguments.
+// State written on every emit or call is aligned to cache lines of its own, so that writing it does not invalidate the
+// read-mostly state emits read on other cores.
+constexpr size_t kCacheLineSize = 64;
+
+// True if every normalized argument type is a const reference, so the arguments can be copied and the call deferred.
 template <typename... Args>
-using FunctionVector = std::vector<FunctionIdPair<Args...>>;
+struct AllConstReferences : std::true_type
+{
+};
 
-// Base class for a vector of functions. It will be inherited by DerivedFunctionVector.
-struct BaseFunctionVector
+template <typename First, typename... Rest>
+struct AllConstReferences<First, Rest...>
+    : std::integral_constant<bool, std::is_const<typename std::remove_reference<First>::type>::value &&
+                                       AllConstReferences<Rest...>::value>
 {
-    virtual ~BaseFunctionVector() = default;
 };
 
-// Derived class template for holding a vector of functions with specific argument types.
+// True if calls of functions with these normalized argument types can be deferred to the offload workers: the arguments
+// are const references to copyable types. Checked at compile time, so that copying code is never instantiated for
+// signatures that pass move-only payloads in place.
 template <typename... Args>
-struct DerivedFunctionVector : public BaseFunctionVector
+struct Offloadable
+    : std::integral_constant<bool, AllConstReferences<Args...>::value &&
+                                       std::conjunction<std::is_copy_constructible<typename std::decay<Args>::type>...>::value>
 {
-    FunctionVector<Args...> functions;
 };
 
-class EventManager
+struct BaseFunctionVector;
+struct InterceptorChain;
+class EventOwner;
+
+// Key of a function vector in the registry: the event name and the signature of its functions, as FunctionType of the
+// normalized argument types. Keys of one name are adjacent, and EventKeyLess also compares a key with a bare name so
+// that all signatures of a name can be found with equal_range().
+struct EventKey
+{
+    std::string name;
+    std::type_index signature;
+};
+
+struct EventKeyLess
+{
+    using is_transparent = void;
+
+    bool operator()(const EventKey &left, const EventKey &right) const
+    {
+        int order = left.name.compare(right.name);
+        return order != 0 ? order < 0 : left.signature < right.signature;
+    }
+    bool operator()(const EventKey &left, const std::string &right) const { return left.name < right; }
+    bool operator()(const std::string &left, const EventKey &right) const { return left < right.name; }
+};
+
+// Node of the intrusive list of functions registered with an EventOwner.
+struct OwnerLink
+{
+    EventOwner *owner;
+    BaseFunctionVector *functions;
+    size_t id;
+    OwnerLink *previous = nullptr;
+    OwnerLink *next = nullptr;
+
+    // Remove this node from its owner's list and free it.
+    void unlinkAndDelete();
+};
+
+// How onSampled() picks the emits that call a function.
+enum class SamplingMode
+{
+    EveryNth, // The first emit, then every Nth one after it.
+    Random    // Each emit with probability 1/N, drawn from a per-thread generator.
+};
+
+// A registered function with its unique identifier (size_t).
+// Entries are allocated individually so that emits can keep calling them while other threads register or remove
+// functions. Removing a function only clears alive; the entry is retired to the EpochDomain once it leaves the table.
+// An entry spans two cache lines: the first holds what every emit reads to call the function, the second the rest,
+// including the state written by sampled and timed calls.
+template <typename... Args>
+struct alignas(kCacheLineSize) FunctionEntry
+{
+    FunctionEntry(size_t id, FunctionType<Args...> function, std::weak_ptr<void> owner, bool ownerTracked, bool once)
+        : function(std::move(function)), once(once), ownerTracked(ownerTracked), id(id), owner(std::move(owner))
+    {
+    }
+
+    FunctionType<Args...> function;
+    // Set when interceptors applied to the function's event when it was registered. Calls then run them in order.
+    std::shared_ptr<const InterceptorChain> interceptors;
+    // Set by onSampled(). The function is called for one emit in sampleRate; 1 calls it for every emit.
+    uint32_t sampleRate = 1;
+    // Tombstone. Cleared when the function is unregistered, or by the emit that claims a once() function.
+    std::atomic<bool> alive{true};
+    // Set by once(). The first emit to call the function clears alive itself and unregisters it.
+    bool once = false;
+    // Set by onWeak(). The function is skipped and removed once owner has expired.
+    bool ownerTracked = false;
+    bool sampleRandomly = false;
+
+    alignas(kCacheLineSize) size_t id;
+    std::weak_ptr<void> owner;
+    // Set when the function was registered with an EventOwner.
+    OwnerLink *ownerLink = nullptr;
+    // Index of the entry in the current table, kept up to date under the vector's lock.
+    size_t position = 0;
+    // Set once the function has been taken out of the ID index, after which the entry can be dropped from the table.
+    bool removed = false;
+    // Set once the average exceeded the budget, and once calls are moved to the offload workers.
+    std::atomic<bool> slow{false};
+    std::atomic<bool> offloaded{false};
+    // Written by every sampled call.
+    std::atomic<uint32_t> sampleCounter{0};
+    // Moving average of the call time in nanoseconds, kept while a SlowHandlerPolicy is set.
+    std::atomic<int64_t> averageNanos{0};
+};
+
+// Fixed-capacity array of entries in registration order. Functions are appended in place while there is room, which
+// leaves emits iterating the first size entries undisturbed. A full table is replaced by a larger copy.
+// Appends claim a slot by incrementing reserved, without a lock, and publish it by advancing size once every earlier
+// slot has been published, so size only ever covers filled slots.
+template <typename... Args>
+struct FunctionTable
+{
+    // Stored in reserved by the writer replacing the table, so that appends racing with it fail and retry on the
+    // replacement. Far enough from the top that the increments of failed appends cannot wrap around.
+    static constexpr size_t kSealed = std::numeric_limits<size_t>::max() / 2;
+
+    explicit FunctionTable(size_t capacity) : capacity(capacity), entries(new FunctionEntry<Args...> *[capacity]) {}
+
+    size_t capacity;
+    std::atomic<size_t> size{0};
+    std::unique_ptr<FunctionEntry<Args...> *[]> entries;
+    // Slots handed out to appends, published or not. On its own line, since every append writes it.
+    alignas(kCacheLineSize) std::atomic<size_t> reserved{0};
+};
+
+// An entry of a NUMA replica: the shared entry, with copies of the members emits read to decide whether to call it.
+// alive is cleared together with the entry's own flag; the emit claiming a once() function still does so on the entry.
+template <typename... Args>
+struct ReplicaSlot
+{
+    FunctionEntry<Args...> *entry;
+    std::atomic<bool> alive;
+    bool once;
+    bool ownerTracked;
+    uint32_t sampleRate;
+};
+
+// Copy of a function table at one size, local to the NUMA node of the emit that built it.
+template <typename... Args>
+struct FunctionReplica
+{
+    FunctionReplica(const FunctionTable<Args...> *source, size_t size)
+        : source(source), size(size), slots(new ReplicaSlot<Args...>[size])
+    {
+        for (size_t position = 0; position < size; ++position)
+        {
+            FunctionEntry<Args...> *entry = source->entries[position];
+            ReplicaSlot<Args...> &slot = slots[position];
+            slot.entry = entry;
+            slot.alive.store(entry->alive.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            slot.once = entry->once;
+            slot.ownerTracked = entry->ownerTracked;
+            slot.sampleRate = entry->sampleRate;
+        }
+    }
+
+    // The table it copies.
+    const FunctionTable<Args...> *source;
+    size_t size;
+    std::unique_ptr<ReplicaSlot<Args...>[]> slots;
+};
+
+// NUMA nodes that get their own table replicas. Nodes beyond this share replicas.
+constexpr size_t kMaxNumaNodes = 8;
+
+// Memory used by the registry, as reported by EventManager::memoryUsage(). Heap state owned by the registered functions
+// themselves (captures too large for std::function's small buffer) is not visible and not included.
+struct EventMemoryUsage
+{
+    size_t events = 0;
+    size_t functions = 0;
+    // Bytes of map nodes, event names and function vector objects.
+    size_t eventBytes = 0;
+    // Bytes of function entries (removed ones awaiting collection included), tables, ID indexes and owner links.
+    size_t functionBytes = 0;
+
+    size_t bytesPerEvent() const { return events != 0 ? (eventBytes + functionBytes) / events : 0; }
+    size_t bytesPerFunction() const { return functions != 0 ? functionBytes / functions : 0; }
+};
+
+// Epoch-based reclamation of the tables, entries and vectors that emits read without locks. An emit announces the
+// global epoch on entry and withdraws it on exit; an object unlinked by a writer is retired with the epoch of the time
+// and freed in a batch once the global epoch is two past it, which no emit can reach while still reading the object.
+// The epoch only advances when every announcing thread has caught up with it, so a long-running function delays
+// reclamation, never correctness. Emits touch only their own thread's record and one read-mostly counter.
+class EpochDomain
 {
+    struct LocalState;
+
 public:
-    // Static method to access the Singleton instance.
-    static EventManager &getInstance()
+    // A thread's announcement. Records are never freed, so a thread that outlives the domain can still release its own.
+    struct alignas(kCacheLineSize) Record
     {
-        static EventManager instance;
-        return instance;
+        std::atomic<uint64_t> epoch{kIdle};
+        std::atomic<bool> inUse{true};
+        Record *next = nullptr;
+    };
+
+    // Announces the epoch for as long as it lives. Nested guards on one thread share the outermost announcement.
+    class Guard
+    {
+    public:
+        explicit Guard(EpochDomain &domain) : local(domain.localState())
+        {
+            if (local.depth++ == 0)
+                domain.announce(*local.record);
+        }
+        ~Guard()
+        {
+            if (--local.depth == 0)
+                local.record->epoch.store(kIdle, std::memory_order_release);
+        }
+
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+
+    private:
+        LocalState &local;
+    };
+
+    ~EpochDomain()
+    {
+        // No emit can be running once the domain is destroyed.
+        for (const Retired &retired : retiredObjects)
+            retired.destroy(retired.object);
     }
 
-    // Register a function or lambda function with a specific event name.
-    template <typename... Args, typename F>
-    size_t on(std::string eventName, F &&newFunc);
+    // Hold the epoch announced by the calling thread, which must be inside a Guard, on a record of its own until
+    // release() is called from any thread. Lets work queued from an emit keep reading what the emit could read.
+    Record *pin()
+    {
+        Record *record = acquireRecord();
+        record->epoch.store(localState().record->epoch.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+        return record;
+    }
 
-    template <typename... Args>
-    void off(std::string eventName, size_t id);
+    // Lower the epoch held by a pinned record to the one announced by the calling thread, which must be inside a Guard,
+    // so that the record also covers what the caller can read. Calls on one record must not run concurrently.
+    void extendPin(Record *record)
+    {
+        uint64_t epoch = localState().record->epoch.load(std::memory_order_relaxed);
+        if (epoch < record->epoch.load(std::memory_order_relaxed))
+            record->epoch.store(epoch, std::memory_order_seq_cst);
+    }
 
-    // Emit an event with the specified name and pass arguments to the registered functions.
-    template <typename... Args>
-    void emitEvent(std::string eventName, Args... args);
+    static void release(Record *record)
+    {
+        record->epoch.store(kIdle, std::memory_order_release);
+        record->inUse.store(false, std::memory_order_release);
+    }
+
+    // Free object with delete once no emit can be reading it. bytes is what it holds, for memoryUsage().
+    template <typename T>
+    void retire(T *object, size_t bytes)
+    {
+        retire(object, [](void *pointer)
+               { delete static_cast<T *>(pointer); }, bytes);
+    }
+
+    // Pass object to destroy once no emit can be reading it.
+    void retire(void *object, void (*destroy)(void *), size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(retiredMutex);
+        retiredObjects.push_back(Retired{globalEpoch.load(std::memory_order_seq_cst), object, destroy, bytes});
+        retiredCount.store(retiredObjects.size(), std::memory_order_relaxed);
+        retiredBytes += bytes;
+    }
+
+    // Free the retired objects no emit can be reading any more, once at least kBatch of them have accumulated or if
+    // force is set. Must not be called with a lock that a destructor of a registered function might take.
+    void collect(bool force = false)
+    {
+        if (retiredCount.load(std::memory_order_relaxed) < (force ? 1 : kBatch))
+            return;
+        std::deque<Retired> ready;
+        {
+            std::lock_guard<std::mutex> lock(retiredMutex);
+            // Objects retired in the current epoch need two advances.
+            for (int step = 0; step < 2 && tryAdvance(); ++step)
+            {
+            }
+            uint64_t epoch = globalEpoch.load(std::memory_order_relaxed);
+            while (!retiredObjects.empty() && retiredObjects.front().epoch + 2 <= epoch)
+            {
+                retiredBytes -= retiredObjects.front().bytes;
+                ready.push_back(retiredObjects.front());
+                retiredObjects.pop_front();
+            }
+            retiredCount.store(retiredObjects.size(), std::memory_order_relaxed);
+        }
+        // Destroying a function may run arbitrary code, including off(), so it happens outside the lock.
+        for (const Retired &retired : ready)
+            retired.destroy(retired.object);
+    }
+
+    // Bytes held by objects awaiting reclamation.
+    size_t pendingBytes() const
+    {
+        std::lock_guard<std::mutex> lock(retiredMutex);
+        return retiredBytes;
+    }
 
 private:
-    // Private constructor.
-    EventManager() = default;
+    static constexpr uint64_t kIdle = UINT64_MAX;
+    static constexpr size_t kBatch = 64;
 
-    // Delete copy constructor and copy assignment operator.
-    EventManager(const EventManager &) = delete;
-    EventManager &operator=(const EventManager &) = delete;
-    // A map that associates event names with their respective function vectors.
-    std::map<std::string, std::shared_ptr<BaseFunctionVector>> functionsMap;
-    std::mutex functionsMapMutex;
+    struct Retired
+    {
+        uint64_t epoch;
+        void *object;
+        void (*destroy)(void *);
+        size_t bytes;
+    };
+
+    // The calling thread's record. EventManager is a singleton, so there is one domain to keep a record for.
+    struct LocalState
+    {
+        Record *record = nullptr;
+        unsigned depth = 0;
+
+        ~LocalState()
+        {
+            if (record != nullptr)
+                release(record);
+        }
+    };
+
+    LocalState &localState()
+    {
+        thread_local LocalState local;
+        if (local.record == nullptr)
+            local.record = acquireRecord();
+        return local;
+    }
+
+    // Announce the global epoch, and announce again if it advanced meanwhile: an advance that missed the announcement
+    // is seen by the second read.
+    void announce(Record &record)
+    {
+        uint64_t epoch = globalEpoch.load(std::memory_order_seq_cst);
+        for (;;)
+        {
+            record.epoch.store(epoch, std::memory_order_seq_cst);
+            uint64_t current = globalEpoch.load(std::memory_order_seq_cst);
+            if (current == epoch)
+                return;
+            epoch = current;
+        }
+    }
+
+    // Reuse a released record, or push a new one onto the list.
+    Record *acquireRecord()
+    {
+        for (Record *record = records.load(std::memory_order_acquire); record != nullptr; record = record->next)
+        {
+            bool expected = false;
+            if (!record->inUse.load(std::memory_order_relaxed) &&
+                record->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                return record;
+        }
+        auto *record = new Record;
+        record->next = records.load(std::memory_order_relaxed);
+        while (!records.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+        return record;
+    }
+
+    // Advance the global epoch if every announcing thread has caught up with it. retiredMutex must be held.
+    bool tryAdvance()
+    {
+        uint64_t epoch = globalEpoch.load(std::memory_order_seq_cst);
+        for (Record *record = records.load(std::memory_order_acquire); record != nullptr; record = record->next)
+        {
+            uint64_t announced = record->epoch.load(std::memory_order_seq_cst);
+            if (announced != kIdle && announced != epoch)
+                return false;
+        }
+        globalEpoch.store(epoch + 1, std::memory_order_seq_cst);
+        return true;
+    }
+
+    alignas(kCacheLineSize) std::atomic<uint64_t> globalEpoch{0};
+    std::atomic<Record *> records{nullptr};
+    alignas(kCacheLineSize) mutable std::mutex retiredMutex;
+    // Retired objects in the order, and so the epoch order, they were retired.
+    std::deque<Retired> retiredObjects;
+    std::atomic<size_t> retiredCount{0};
+    size_t retiredBytes = 0;
 };
 
-// Register a function or lambda function with a specific event name.
-template <typename... Args, typename F>
-size_t EventManager::on(std::string eventName, F &&newFunc)
+// Base class for a vector of functions. It will be inherited by DerivedFunctionVector.
+// Members that are not atomic are guarded by functionsMutex together with a shared lock of
+// EventManager::functionsMapMutex, or by an exclusive lock of functionsMapMutex alone.
+// Vectors are owned through VectorRef, which destroys the last reference's vector through destroy(). The vtable is needed
+// for the other operations anyway, so this costs no extra pointer per vector.
+struct BaseFunctionVector
 {
-    std::lock_guard<std::mutex> lock(functionsMapMutex);
-    FunctionType<Args...> func = newFunc;
-    auto itr = functionsMap.find(eventName);
-    size_t id = 0;
-
-    // If the event name already exists, add the new function to the existing vector.
-    if (itr != functionsMap.end())
+    // Drop a reference, destroying the vector with the last one.
+    static void releaseReference(BaseFunctionVector *vector)
     {
-        auto &functions = static_cast<DerivedFunctionVector<Args...> *>(itr->second.get())->functions;
-        id = functions.size();
-        functions.emplace_back(id, func);
+        if (vector->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            vector->destroy();
     }
-    // If the event name does not exist, create a new vector and add the function to it.
-    else
+
+    // Delete the derived vector.
+    virtual void destroy() = 0;
+
+    // Remove the function with the specified ID and return whether it was still registered. Safe while emits are
+    // iterating the vector.
+    virtual bool remove(size_t id) = 0;
+
+    // Remove functions whose onWeak() owner has expired.
+    virtual void removeExpired() = 0;
+
+    // Drop removed entries from the table once enough have accumulated, retiring them and the old table.
+    virtual void collectGarbage() = 0;
+
+    // Like collectGarbage(), but always drop removed entries and release spare capacity.
+    virtual void compact() = 0;
+
+    // Add the bytes held by this vector to usage.
+    virtual void addMemoryUsage(EventMemoryUsage &usage) const = 0;
+
+    // Key of this vector in the functions map, or nullptr once the event has been reclaimed.
+    const EventKey *eventKey = nullptr;
+    // Name of the event. Unlike eventKey it never changes after creation, so emits may read it without functionsMapMutex.
+    std::string eventName;
+    size_t eventNameHash = 0;
+    // Signature of the functions in this vector, as FunctionType of the normalized argument types.
+    const std::type_info *signature = nullptr;
+    // The signature demangled once per signature, shared by every vector of that signature and never freed.
+    const std::string *signatureText = nullptr;
+    // Number of functions registered in the whole manager, kept alongside functionCount.
+    std::atomic<size_t> *registryFunctionCount = nullptr;
+    // Where replaced tables and dropped entries are retired. Emits iterate a table without locks, so a table is never
+    // modified in place once it has been published, except for appends past its size.
+    EpochDomain *epochs = nullptr;
+
+    // The members below are written by handles or registration. They start a new cache line, and the members of the
+    // derived vector, which emits read, start the one after.
+
+    // Number of registered functions, and of appends in progress. Read by introspection without any lock.
+    alignas(kCacheLineSize) std::atomic<size_t> functionCount{0};
+    // Set when the event is being reclaimed. Appends that find it set give up and register under the registry lock.
+    std::atomic<bool> reclaimed{false};
+    // Number of EventHandles referring to this vector. The event is not reclaimed while it is non-zero.
+    std::atomic<size_t> handleCount{0};
+    // Serializes removal, table replacement and locked registration on this event among threads sharing
+    // functionsMapMutex. Lock-free appends do not take it.
+    std::mutex functionsMutex;
+    // Number of VectorRefs, starting with the one the registry adopts on creation. Emits hold none.
+    std::atomic<size_t> references{1};
+
+    // Mark an empty vector reclaimed, or return false if an append started meanwhile. Called under the exclusive lock
+    // of functionsMapMutex. Appends count themselves in functionCount before they check reclaimed, and both sides use
+    // sequentially consistent accesses, so at least one of the two sees the other and backs off.
+    bool markReclaimed()
     {
-        auto functionVector = std::make_shared<DerivedFunctionVector<Args...>>();
-        functionVector->functions.emplace_back(id, func);
-        functionsMap.insert({eventName, functionVector});
+        reclaimed.store(true, std::memory_order_seq_cst);
+        if (functionCount.load(std::memory_order_seq_cst) == 0)
+            return true;
+        reclaimed.store(false, std::memory_order_relaxed);
+        return false;
     }
 
-    return id;
-}
+protected:
+    ~BaseFunctionVector() = default;
+};
 
-// Method to remove a function with a specific event name and function ID.
-template <typename... Args>
-void EventManager::off(std::string eventName, size_t id)
+// Counted reference to a function vector, holding the count in the vector itself instead of a separate control block.
+template <typename T>
+class VectorRef
 {
-    std::lock_guard<std::mutex> lock(functionsMapMutex);
-    auto itr = functionsMap.find(eventName);
+public:
+    VectorRef() = default;
+    VectorRef(std::nullptr_t) {}
+    // Take a new reference. The vector must already be kept alive by another one.
+    explicit VectorRef(T *vector) : vector(vector)
+    {
+        if (vector != nullptr)
+            vector->references.fetch_add(1, std::memory_order_relaxed);
+    }
+    VectorRef(const VectorRef &other) : VectorRef(other.vector) {}
+    VectorRef(VectorRef &&other) noexcept : vector(other.vector) { other.vector = nullptr; }
+    ~VectorRef()
+    {
+        if (vector != nullptr)
+            BaseFunctionVector::releaseReference(vector);
+    }
 
-    if (itr != functionsMap.end())
+    VectorRef &operator=(VectorRef other) noexcept
     {
-        auto &functions = static_cast<DerivedFunctionVector<Args...> *>(itr->second.get())->functions;
-        functions.erase(std::remove_if(functions.begin(), functions.end(),
-                                       [&](const FunctionIdPair<Args...> &pair)
-                                       { return pair.first == id; }),
-                        functions.end());
+        std::swap(vector, other.vector);
+        return *this;
     }
-}
 
-// Emit an event with the specified name and pass arguments to the registered functions.
+    // Wrap the reference a newly created vector starts with.
+    static VectorRef adopt(T *vector)
+    {
+        VectorRef reference;
+        reference.vector = vector;
+        return reference;
+    }
+
+    // Give up the reference without dropping it. The caller drops it later with BaseFunctionVector::releaseReference().
+    T *detach()
+    {
+        T *detached = vector;
+        vector = nullptr;
+        return detached;
+    }
+
+    T *get() const { return vector; }
+    T &operator*() const { return *vector; }
+    T *operator->() const { return vector; }
+    explicit operator bool() const { return vector != nullptr; }
+    bool operator==(std::nullptr_t) const { return vector == nullptr; }
+    bool operator!=(std::nullptr_t) const { return vector != nullptr; }
+
+private:
+    T *vector = nullptr;
+};
+
+// Derived class template for holding a vector of functions with specific argument types.
+// Removal leaves a tombstone in the table, so no other function moves and emits in flight are unaffected. Tombstones are
+// compacted in one batch when they make up more than half of the table.
 template <typename... Args>
-void EventManager::emitEvent(std::string eventName, Args... args)
+struct DerivedFunctionVector final : public BaseFunctionVector
 {
-    std::lock_guard<std::mutex> lock(functionsMapMutex);
-    auto itr = functionsMap.find(eventName);
+    // Owns every entry it lists, including tombstones. Aligned explicitly, since the derived members could otherwise
+    // be laid out in the tail padding of the base, next to functionCount.
+    alignas(kCacheLineSize) std::atomic<FunctionTable<Args...> *> table{new FunctionTable<Args...>(4)};
+    // Registered entries, by ID. Appends do not index their entries, so that they need no lock; the first of
+    // indexedSize entries of the table are indexed, and whatever looks an ID up indexes the rest first.
+    std::unordered_map<size_t, FunctionEntry<Args...> *> entriesById;
+    size_t indexedSize = 0;
+    size_t deadEntries = 0;
+    // Copies of the table per NUMA node. A replica is used only while it copies the current table at its current size;
+    // it is rebuilt by an emit on its node after appends, and retired with the table when the table is replaced.
+    std::atomic<FunctionReplica<Args...> *> replicas[kMaxNumaNodes] = {};
+
+    ~DerivedFunctionVector()
+    {
+        FunctionTable<Args...> *current = table.load(std::memory_order_relaxed);
+        for (size_t position = 0; position < current->size.load(std::memory_order_relaxed); ++position)
+            delete current->entries[position];
+        delete current;
+        for (auto &replica : replicas)
+            delete replica.load(std::memory_order_relaxed);
+    }
+
+    void destroy() override { delete this; }
+
+    // Return the replica of current for the given node, or nullptr if it is stale and cannot be rebuilt now. Called by
+    // emits, which rebuild a stale replica only if the locks are free, so that an emit never waits for them. The calling
+    // thread runs on the node, so the replica it allocates and fills is local to that node. Holding functionsMutex
+    // while copying keeps remove() from clearing an entry between the copy of its flag and the publication.
+    FunctionReplica<Args...> *replicaFor(size_t node, FunctionTable<Args...> *current, size_t size,
+                                         std::shared_mutex &registryMutex)
+    {
+        FunctionReplica<Args...> *replica = replicas[node].load(std::memory_order_acquire);
+        if (replica != nullptr && replica->source == current && replica->size == size)
+            return replica;
+
+        std::shared_lock<std::shared_mutex> registryLock(registryMutex, std::try_to_lock);
+        if (!registryLock.owns_lock())
+            return nullptr;
+        std::unique_lock<std::mutex> lock(functionsMutex, std::try_to_lock);
+        if (!lock.owns_lock() || table.load(std::memory_order_relaxed) != current ||
+            current->size.load(std::memory_order_relaxed) != size)
+            return nullptr;
+        auto *fresh = new FunctionReplica<Args...>(current, size);
+        replica = replicas[node].exchange(fresh, std::memory_order_acq_rel);
+        if (replica != nullptr)
+            retireReplica(replica);
+        return fresh;
+    }
+
+    // Build an entry for tryAppend() or add().
+    static std::unique_ptr<FunctionEntry<Args...>> makeEntry(size_t id, FunctionType<Args...> function,
+                                                             std::shared_ptr<const InterceptorChain> interceptors,
+                                                             std::weak_ptr<void> owner, bool ownerTracked, bool once,
+                                                             SamplingMode samplingMode, uint32_t sampleRate)
+    {
+        auto entry = std::make_unique<FunctionEntry<Args...>>(id, std::move(function), std::move(owner), ownerTracked, once);
+        entry->interceptors = std::move(interceptors);
+        entry->sampleRate = std::max<uint32_t>(sampleRate, 1);
+        entry->sampleRandomly = samplingMode == SamplingMode::Random;
+        return entry;
+    }
+
+    // Append an entry without taking any lock, inside the caller's EpochDomain::Guard. Fails, leaving entry with the
+    // caller, when the vector is being reclaimed or the table is full or being replaced; the caller then adds it with
+    // add() under the locks.
+    bool tryAppend(std::unique_ptr<FunctionEntry<Args...>> &entry)
+    {
+        functionCount.fetch_add(1, std::memory_order_seq_cst);
+        if (reclaimed.load(std::memory_order_seq_cst) || !appendToTable(entry.get()))
+        {
+            functionCount.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        entry.release();
+        registryFunctionCount->fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Append an entry under functionsMutex, growing the table if it is full, and index it.
+    FunctionEntry<Args...> *add(std::unique_ptr<FunctionEntry<Args...>> entry)
+    {
+        functionCount.fetch_add(1, std::memory_order_relaxed);
+        while (!appendToTable(entry.get()))
+        {
+            FunctionTable<Args...> *current = table.load(std::memory_order_relaxed);
+            collectGarbage();
+            if (table.load(std::memory_order_relaxed) == current)
+                replaceTable(2 * current->capacity);
+        }
+        registryFunctionCount->fetch_add(1, std::memory_order_relaxed);
+        indexAppended();
+        return entry.release();
+    }
+
+    // Claim a slot of the current table and publish entry in it after the slots claimed before it. Returns false once
+    // the table is full or sealed by replaceTable(). Publishing waits only for appends that already claimed a slot,
+    // none of which holds a lock, so the wait lasts no longer than writing a few pointers.
+    bool appendToTable(FunctionEntry<Args...> *entry)
+    {
+        FunctionTable<Args...> *current = table.load(std::memory_order_acquire);
+        size_t slot = current->reserved.fetch_add(1, std::memory_order_relaxed);
+        if (slot >= current->capacity)
+            return false;
+        entry->position = slot;
+        current->entries[slot] = entry;
+        while (current->size.load(std::memory_order_acquire) != slot)
+            std::this_thread::yield();
+        current->size.store(slot + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Index the entries appended since the last call.
+    void indexAppended()
+    {
+        FunctionTable<Args...> *current = table.load(std::memory_order_relaxed);
+        size_t size = current->size.load(std::memory_order_acquire);
+        for (; indexedSize < size; ++indexedSize)
+            entriesById.emplace(current->entries[indexedSize]->id, current->entries[indexedSize]);
+    }
+
+    // Also finalizes a once() function whose tombstone was set by the emit that called it.
+    bool remove(size_t id) override
+    {
+        indexAppended();
+        auto itr = entriesById.find(id);
+        if (itr == entriesById.end())
+            return false;
+        FunctionEntry<Args...> *entry = itr->second;
+        entriesById.erase(itr);
+        entry->alive.store(false, std::memory_order_relaxed);
+        entry->removed = true;
+        // Replicas of older tables or sizes are no longer read by emits, so only current ones need the tombstone.
+        const FunctionTable<Args...> *current = table.load(std::memory_order_relaxed);
+        for (auto &replica : replicas)
+        {
+            FunctionReplica<Args...> *copy = replica.load(std::memory_order_relaxed);
+            if (copy != nullptr && copy->source == current && entry->position < copy->size)
+                copy->slots[entry->position].alive.store(false, std::memory_order_relaxed);
+        }
+        if (entry->ownerLink != nullptr)
+        {
+            entry->ownerLink->unlinkAndDelete();
+            entry->ownerLink = nullptr;
+        }
+        functionCount.fetch_sub(1, std::memory_order_relaxed);
+        registryFunctionCount->fetch_sub(1, std::memory_order_relaxed);
+        ++deadEntries;
+        collectGarbage();
+        return true;
+    }
 
-    // If the event name exists, execute all registered functions with the provided arguments.
-    if (itr != functionsMap.end())
+    void removeExpired() override
     {
-        auto &functions = static_cast<DerivedFunctionVector<Args...> *>(itr->second.get())->functions;
-        for (auto &funcPair : functions)
+        indexAppended();
+        std::vector<size_t> expired;
+        for (const auto &idEntry : entriesById)
+        {
+            if (idEntry.second->ownerTracked && idEntry.second->owner.expired())
+                expired.push_back(idEntry.first);
+        }
+        for (size_t id : expired)
+            remove(id);
+    }
+
+    void collectGarbage() override
+    {
+        FunctionTable<Args...> *current = table.load(std::memory_order_relaxed);
+        if (deadEntries * 2 > current->size.load(std::memory_order_relaxed))
+            removeDeadEntries(false);
+    }
+
+    void compact() override
+    {
+        indexAppended();
+        removeDeadEntries(true);
+        entriesById.rehash(0);
+    }
+
+    void retireTable(FunctionTable<Args...> *retired)
+    {
+        epochs->retire(retired, sizeof(*retired) + retired->capacity * sizeof(FunctionEntry<Args...> *));
+    }
+
+    void retireReplica(FunctionReplica<Args...> *retired)
+    {
+        epochs->retire(retired, sizeof(*retired) + retired->size * sizeof(ReplicaSlot<Args...>));
+    }
+
+    void addMemoryUsage(EventMemoryUsage &usage) const override
+    {
+        FunctionTable<Args...> *current = table.load(std::memory_order_relaxed);
+        usage.eventBytes += sizeof(*this);
+        usage.functionBytes += sizeof(*current) + current->capacity * sizeof(FunctionEntry<Args...> *) +
+                               current->size.load(std::memory_order_relaxed) * sizeof(FunctionEntry<Args...>) +
+                               entriesById.bucket_count() * sizeof(void *) +
+                               entriesById.size() * (sizeof(std::pair<const size_t, void *>) + 2 * sizeof(void *));
+        for (const auto &replica : replicas)
+        {
+            FunctionReplica<Args...> *copy = replica.load(std::memory_order_relaxed);
+            if (copy != nullptr)
+                usage.functionBytes += sizeof(*copy) + copy->size * sizeof(ReplicaSlot<Args...>);
+        }
+        for (const auto &idEntry : entriesById)
+        {
+            if (idEntry.second->ownerLink != nullptr)
+                usage.functionBytes += sizeof(OwnerLink);
+        }
+        usage.functions += functionCount.load(std::memory_order_relaxed);
+    }
+
+    // Publish a copy of the table with the given capacity, leaving out tombstones if dropDead is set. The old table and
+    // the dropped entries are retired until no emit can be reading them. Sealing the table first makes appends that
+    // have not claimed a slot yet fail over to add(), which waits for this call under functionsMutex; those that have
+    // claimed one are waited for, so that they are copied too.
+    FunctionTable<Args...> *replaceTable(size_t capacity, bool dropDead = false)
+    {
+        FunctionTable<Args...> *current = table.load(std::memory_order_relaxed);
+        size_t size = std::min(current->reserved.exchange(FunctionTable<Args...>::kSealed, std::memory_order_relaxed),
+                               current->capacity);
+        while (current->size.load(std::memory_order_acquire) != size)
+            std::this_thread::yield();
+        indexAppended();
+        // The caller sized the table before the appends that were still in progress, which all have to fit.
+        capacity = std::max(capacity, dropDead ? size - deadEntries : size);
+        auto *replacement = new FunctionTable<Args...>(capacity);
+        size_t kept = 0;
+        for (size_t position = 0; position < size; ++position)
+        {
+            FunctionEntry<Args...> *entry = current->entries[position];
+            // Tombstones are dropped by removed, not by alive: a once() entry claimed by an emit has alive cleared but
+            // is still in the ID index until that emit's remove(id), which would read it after it was freed.
+            if (dropDead && entry->removed)
+            {
+                assert(entriesById.find(entry->id) == entriesById.end() && "dropping an entry that is still indexed");
+                continue;
+            }
+            entry->position = kept;
+            replacement->entries[kept++] = entry;
+        }
+        replacement->size.store(kept, std::memory_order_relaxed);
+        replacement->reserved.store(kept, std::memory_order_relaxed);
+        indexedSize = kept;
+        // Published before the old table and the dropped entries are retired, so an emit that still loads the old table
+        // announced an epoch no later than the retirement.
+        table.store(replacement);
+        if (dropDead)
+        {
+            for (size_t position = 0; position < size; ++position)
+            {
+                if (current->entries[position]->removed)
+                    epochs->retire(current->entries[position], sizeof(FunctionEntry<Args...>));
+            }
+        }
+        retireTable(current);
+        for (auto &replica : replicas)
+        {
+            FunctionReplica<Args...> *copy = replica.exchange(nullptr);
+            if (copy != nullptr)
+                retireReplica(copy);
+        }
+        return replacement;
+    }
+
+    // Replace the table by one without tombstones, giving back capacity once occupancy falls below a quarter.
+    void removeDeadEntries(bool shrinkToFit)
+    {
+        if (deadEntries == 0 && !shrinkToFit)
+            return;
+        FunctionTable<Args...> *current = table.load(std::memory_order_relaxed);
+        size_t live = current->size.load(std::memory_order_relaxed) - deadEntries;
+        size_t minimumCapacity = std::max<size_t>(live, 4);
+        size_t capacity = current->capacity;
+        if (shrinkToFit ? capacity > minimumCapacity : capacity > 4 * minimumCapacity)
+            capacity = minimumCapacity;
+        if (deadEntries != 0 || capacity != current->capacity)
+            replaceTable(capacity, true);
+        deadEntries = 0;
+    }
+};
+
+// Hash index of the function vectors by event name and signature, searched by emits without taking any lock, so that
+// emits by name write nothing shared. Changed only under an exclusive lock of EventManager::functionsMapMutex; unlinked
+// nodes and replaced bucket arrays are retired to the EpochDomain, so searches must run inside an EpochDomain::Guard.
+// Nodes point to their vector for the key, which is valid for as long as the node is reachable.
+class EventLookup
+{
+public:
+    explicit EventLookup(EpochDomain &epochs) : epochs(epochs), buckets(new Buckets(16)) {}
+
+    ~EventLookup() { destroyBuckets(buckets.load(std::memory_order_relaxed)); }
+
+    BaseFunctionVector *find(const std::string &eventName, size_t eventNameHash, const std::type_info &signature) const
+    {
+        const Buckets *current = buckets.load(std::memory_order_acquire);
+        size_t bucket = mix(eventNameHash, signature) & (current->count - 1);
+        for (Node *node = current->heads[bucket].load(std::memory_order_acquire); node != nullptr;
+             node = node->next.load(std::memory_order_acquire))
+        {
+            BaseFunctionVector *functions = node->functions;
+            if (functions->eventNameHash == eventNameHash && *functions->signature == signature &&
+                functions->eventName == eventName)
+                return functions;
+        }
+        return nullptr;
+    }
+
+    // Add a vector whose name, hash and signature are set. Grows the buckets once there are more vectors than buckets.
+    void insert(BaseFunctionVector *functions)
+    {
+        Buckets *current = buckets.load(std::memory_order_relaxed);
+        if (++size > current->count)
+        {
+            auto *grown = new Buckets(2 * current->count);
+            for (size_t bucket = 0; bucket < current->count; ++bucket)
+            {
+                for (Node *node = current->heads[bucket].load(std::memory_order_relaxed); node != nullptr;
+                     node = node->next.load(std::memory_order_relaxed))
+                    link(*grown, node->functions);
+            }
+            buckets.store(grown, std::memory_order_release);
+            epochs.retire(current, &destroyBuckets, current->bytes(size - 1));
+            current = grown;
+        }
+        link(*current, functions);
+    }
+
+    void erase(BaseFunctionVector *functions)
+    {
+        Buckets *current = buckets.load(std::memory_order_relaxed);
+        std::atomic<Node *> *previous = &current->heads[mix(functions->eventNameHash, *functions->signature) & (current->count - 1)];
+        for (Node *node = previous->load(std::memory_order_relaxed); node != nullptr;
+             node = previous->load(std::memory_order_relaxed))
+        {
+            if (node->functions == functions)
+            {
+                // Searches that already reached the node continue from its next, which stays valid until it is freed.
+                previous->store(node->next.load(std::memory_order_relaxed), std::memory_order_release);
+                epochs.retire(node, sizeof(Node));
+                --size;
+                return;
+            }
+            previous = &node->next;
+        }
+    }
+
+    size_t bytes() const { return sizeof(Buckets) + buckets.load(std::memory_order_relaxed)->bytes(size); }
+
+private:
+    struct Node
+    {
+        BaseFunctionVector *functions;
+        std::atomic<Node *> next;
+    };
+
+    struct Buckets
+    {
+        explicit Buckets(size_t count) : count(count), heads(new std::atomic<Node *>[count])
+        {
+            for (size_t bucket = 0; bucket < count; ++bucket)
+                heads[bucket].store(nullptr, std::memory_order_relaxed);
+        }
+
+        size_t bytes(size_t nodes) const { return count * sizeof(std::atomic<Node *>) + nodes * sizeof(Node); }
+
+        size_t count;
+        std::unique_ptr<std::atomic<Node *>[]> heads;
+    };
+
+    static size_t mix(size_t eventNameHash, const std::type_info &signature)
+    {
+        return eventNameHash ^ (signature.hash_code() + 0x9e3779b9 + (eventNameHash << 6) + (eventNameHash >> 2));
+    }
+
+    // Push a node at the head of its bucket. Published with release, so a search that reaches it sees the vector.
+    static void link(Buckets &target, BaseFunctionVector *functions)
+    {
+        std::atomic<Node *> &head = target.heads[mix(functions->eventNameHash, *functions->signature) & (target.count - 1)];
+        head.store(new Node{functions, {head.load(std::memory_order_relaxed)}}, std::memory_order_release);
+    }
+
+    // Free a bucket array with the nodes it links. Nodes are never shared between arrays.
+    static void destroyBuckets(void *pointer)
+    {
+        auto *retired = static_cast<Buckets *>(pointer);
+        for (size_t bucket = 0; bucket < retired->count; ++bucket)
+        {
+            Node *node = retired->heads[bucket].load(std::memory_order_relaxed);
+            while (node != nullptr)
+            {
+                Node *next = node->next.load(std::memory_order_relaxed);
+                delete node;
+                node = next;
+            }
+        }
+        delete retired;
+    }
+
+    EpochDomain &epochs;
+    std::atomic<Buckets *> buckets;
+    // Number of vectors indexed. Guarded by the exclusive lock.
+    size_t size = 0;
+};
+
+class EventManager;
+
+// An event name and signature resolved once by EventManager::handle(). Emitting through it skips the lookup, and keeps
+// the event registered even while it has no functions. An event left without functions is reclaimed when its last
+// handle is destroyed.
+template <typename... Args>
+class EventHandle
+{
+public:
+    EventHandle() = default;
+    EventHandle(const EventHandle &other) : manager(other.manager), functions(other.functions) { acquire(); }
+    EventHandle(EventHandle &&other) noexcept : manager(other.manager), functions(std::move(other.functions)) {}
+    ~EventHandle() { releaseHandle(); }
+
+    EventHandle &operator=(EventHandle other) noexcept
+    {
+        std::swap(manager, other.manager);
+        std::swap(functions, other.functions);
+        return *this;
+    }
+
+    explicit operator bool() const { return functions != nullptr; }
+
+private:
+    friend class EventManager;
+
+    using Vector = DerivedFunctionVector<NormalizedArgument<Args>...>;
+
+    // Takes over the handle count that handle() added under the registry lock.
+    EventHandle(EventManager *manager, VectorRef<Vector> functions)
+        : manager(manager), functions(std::move(functions)) {}
+
+    void acquire()
+    {
+        if (functions)
+            functions->handleCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void releaseHandle();
+
+    EventManager *manager = nullptr;
+    VectorRef<Vector> functions;
+};
+
+// Move-only token returned by EventManager::subscribe(). Destroying it unregisters the function in O(1), without looking
+// up the event name or scanning the function vector.
+class Subscription
+{
+public:
+    Subscription() = default;
+    Subscription(Subscription &&other) noexcept;
+    Subscription &operator=(Subscription &&other) noexcept;
+    ~Subscription() { unsubscribe(); }
+
+    Subscription(const Subscription &) = delete;
+    Subscription &operator=(const Subscription &) = delete;
+
+    // Unregister the function now. Does nothing if it was already unregistered or released.
+    void unsubscribe();
+
+    // Keep the function registered after this token is destroyed. Returns its ID for use with off().
+    size_t release();
+
+    // Whether this token still owns a registered function.
+    explicit operator bool() const { return functions != nullptr; }
+
+private:
+    friend class EventManager;
+
+    Subscription(EventManager *manager, VectorRef<BaseFunctionVector> functions, size_t id)
+        : manager(manager), functions(std::move(functions)), id(id) {}
+
+    EventManager *manager = nullptr;
+    VectorRef<BaseFunctionVector> functions;
+    size_t id = 0;
+};
+
+// Groups functions so that they can be unregistered together with EventManager::offAll(), for example all the functions
+// registered on behalf of one session. Destroying the owner unregisters whatever is left.
+class EventOwner
+{
+public:
+    EventOwner() = default;
+    ~EventOwner();
+
+    EventOwner(const EventOwner &) = delete;
+    EventOwner &operator=(const EventOwner &) = delete;
+
+    // Number of functions currently registered with this owner.
+    size_t size() const { return count; }
+
+private:
+    friend class EventManager;
+    friend struct OwnerLink;
+
+    EventManager *manager = nullptr;
+    OwnerLink *head = nullptr;
+    size_t count = 0;
+    // Guards the list against functions of this owner being removed from different events at once.
+    std::mutex mutex;
+};
+
+// How waitAndDispatch() waits for queued events.
+enum class WaitStrategy
+{
+    Adaptive, // Spin for a budget learned from inter-arrival times, then yield, then park.
+    BusyPoll, // Spin until an event arrives. Lowest latency, burns the core.
+    Blocking  // Park immediately. Lowest power, pays the wakeup latency.
+};
+
+// Priority of a queued event. Higher priorities are dispatched first and shed last.
+enum class EventPriority
+{
+    Low,
+    Normal,
+    High,
+    Critical
+};
+
+// Limits applied to queued events. A zero limit is disabled.
+struct SheddingPolicy
+{
+    // Maximum number of pending events. Beyond it the oldest event of the lowest priority that is not above the new
+    // event's is dropped to make room. If every pending event has a higher priority, the new event is dropped instead.
+    size_t maxDepth = 0;
+    // Maximum time an event may wait in the queue. Older events are dropped when they reach dispatch.
+    std::chrono::nanoseconds maxAge{0};
+    // Events at or above this priority are never shed.
+    EventPriority protectedPriority = EventPriority::High;
+};
+
+// Limits on the time a function may take per call. See EventManager::setSlowHandlerPolicy().
+struct SlowHandlerPolicy
+{
+    // Functions whose average call time exceeds this are slow. Zero disables timing.
+    std::chrono::nanoseconds budget{0};
+    // Move calls of slow functions to the offload workers. Functions taking non-const references stay on the emitting
+    // thread, since the emitter expects to see their changes.
+    bool offload = false;
+    // Number of offload workers, started when the first function is offloaded.
+    size_t offloadThreads = 1;
+    // Maximum number of offloaded calls waiting for a worker. Beyond it slow functions are called inline by the emitting
+    // thread again, and counted by EventManager::offloadOverflowCount().
+    size_t maxQueuedCalls = 1024;
+    // Called once per function, on the emitting thread, when it becomes slow.
+    std::function<void(const std::string &eventName, size_t functionId, std::chrono::nanoseconds average)> onSlowHandler;
+};
+
+// When the per-thread buffers filled by EventManager::emitBuffered() are flushed.
+struct EmitBufferPolicy
+{
+    // A buffer is flushed by the emit that brings it to this many events.
+    size_t maxEvents = 64;
+    // A buffer is flushed by the first emit that finds its oldest event this old, or by the manager's flush thread soon
+    // after its oldest event reaches this age. Zero flushes on maxEvents only.
+    std::chrono::nanoseconds maxDelay = std::chrono::milliseconds(1);
+};
+
+// Counters for queued events that were not dispatched, indexed by EventPriority.
+struct SheddingStats
+{
+    static constexpr size_t kPriorityCount = 4;
+
+    // Dropped because the queue was deeper than SheddingPolicy::maxDepth.
+    uint64_t droppedForDepth[kPriorityCount] = {};
+    // Dropped because they waited longer than SheddingPolicy::maxAge.
+    uint64_t droppedForAge[kPriorityCount] = {};
+    // Replaced by a newer instance of the same conflated event.
+    uint64_t conflated[kPriorityCount] = {};
+    // Dropped because their deadline passed before they were dispatched.
+    uint64_t droppedForDeadline[kPriorityCount] = {};
+};
+
+// A call of a registered function, as seen by an interceptor. proceed() calls the next interceptor, or the function
+// itself; an interceptor that does not call it suppresses the call.
+struct InterceptedCall
+{
+    const std::string &eventName;
+    size_t functionId;
+    // The next step of the call, type-erased without allocating.
+    void (*invoke)(void *context);
+    void *context;
+
+    void proceed() const { invoke(context); }
+};
+
+using EventInterceptor = std::function<void(const InterceptedCall &call)>;
+
+// The interceptors that apply to a function, flattened when it is registered: the global ones, then those of its
+// event, each in the order they were added. Shared by the function's entry and the calls in flight.
+struct InterceptorChain
+{
+    std::string eventName;
+    std::vector<EventInterceptor> interceptors;
+};
+
+// An event registered with one signature, as reported by EventManager::listEvents().
+struct EventInfo
+{
+    std::string name;
+    // The function type, demangled where the compiler supports it, e.g. "std::function<void (int const&)>".
+    std::string signature;
+    size_t functions = 0;
+};
+
+// An event name or function reported by EventManager::topEvents() or topHandlers(). The count is an estimate that may
+// exceed the true count, never fall short of it, since the tracking started or was last reset.
+struct HeavyHitter
+{
+    std::string name;
+    uint64_t count = 0;
+};
+
+// Count-min sketch with a table of the most frequent keys. Counting is lock-free; a key whose estimate reaches the
+// table tries to take the table lock, and skips the update rather than wait if another thread holds it. The table is
+// small enough that a linear scan is cheaper than maintaining a heap.
+class HeavyHitterSketch
+{
+public:
+    static constexpr size_t kDepth = 4;
+    static constexpr size_t kWidth = 4096;
+    static constexpr size_t kCapacity = 64;
+
+    // Count one occurrence of the key with the given hash. label() builds its name, only when it enters the table.
+    template <typename Label>
+    void record(size_t hash, const Label &label)
+    {
+        uint64_t estimate = UINT64_MAX;
+        uint64_t mixed = mix(hash);
+        for (size_t row = 0; row < kDepth; ++row)
+        {
+            uint64_t count = counters[row][column(mixed, row)].fetch_add(1, std::memory_order_relaxed) + 1;
+            estimate = std::min(estimate, count);
+        }
+        if (estimate <= threshold.load(std::memory_order_relaxed))
+            return;
+
+        std::unique_lock<std::mutex> lock(topMutex, std::try_to_lock);
+        if (!lock.owns_lock())
+            return;
+        auto itr = std::find_if(topEntries.begin(), topEntries.end(), [hash](const Entry &entry)
+                                { return entry.hash == hash; });
+        if (itr != topEntries.end())
+        {
+            itr->count = std::max(itr->count, estimate);
+        }
+        else if (topEntries.size() < kCapacity)
+        {
+            topEntries.push_back({hash, label(), estimate});
+        }
+        else
+        {
+            itr = std::min_element(topEntries.begin(), topEntries.end(), [](const Entry &left, const Entry &right)
+                                   { return left.count < right.count; });
+            *itr = {hash, label(), estimate};
+        }
+        if (topEntries.size() == kCapacity)
+        {
+            threshold.store(std::min_element(topEntries.begin(), topEntries.end(), [](const Entry &left, const Entry &right)
+                                             { return left.count < right.count; })
+                                ->count,
+                            std::memory_order_relaxed);
+        }
+    }
+
+    // Return up to count of the most frequent keys, most frequent first.
+    std::vector<HeavyHitter> top(size_t count) const
+    {
+        std::vector<HeavyHitter> hitters;
+        {
+            std::lock_guard<std::mutex> lock(topMutex);
+            for (const Entry &entry : topEntries)
+                hitters.push_back({entry.name, entry.count});
+        }
+        std::sort(hitters.begin(), hitters.end(), [](const HeavyHitter &left, const HeavyHitter &right)
+                  { return left.count > right.count; });
+        if (hitters.size() > count)
+            hitters.resize(count);
+        return hitters;
+    }
+
+    // Start counting from zero. Counts racing with the reset may be kept.
+    void reset()
+    {
+        std::lock_guard<std::mutex> lock(topMutex);
+        for (auto &row : counters)
+        {
+            for (auto &counter : row)
+                counter.store(0, std::memory_order_relaxed);
+        }
+        topEntries.clear();
+        threshold.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    struct Entry
+    {
+        size_t hash;
+        std::string name;
+        uint64_t count;
+    };
+
+    // Spread the bits of the hash, since std::hash of an integer is often the identity.
+    static uint64_t mix(uint64_t hash)
+    {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ULL;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    // Each row takes a different 12 bits of the mixed hash.
+    static size_t column(uint64_t mixed, size_t row) { return (mixed >> (row * 12)) & (kWidth - 1); }
+
+    std::atomic<uint64_t> counters[kDepth][kWidth] = {};
+    // Smallest count in the table once it is full, below which keys cannot enter it. Read by every record(), so it does
+    // not share a line with the counters or the lock.
+    alignas(kCacheLineSize) std::atomic<uint64_t> threshold{0};
+    alignas(kCacheLineSize) mutable std::mutex topMutex;
+    std::vector<Entry> topEntries;
+};
+
+// Hardware counters summed over the calls of one function while handler profiling was enabled.
+struct HandlerProfile
+{
+    std::string eventName;
+    size_t functionId = 0;
+    uint64_t calls = 0;
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t cacheMisses = 0;
+    uint64_t branchMisses = 0;
+};
+
+class EventManager
+{
+public:
+    // Static method to access the Singleton instance.
+    static EventManager &getInstance()
+    {
+        static EventManager instance;
+        return instance;
+    }
+
+    // Register a function or lambda function with a specific event name.
+    template <typename... Args, typename F>
+    size_t on(std::string eventName, F &&newFunc);
+
+    // Register a function and return a Subscription that unregisters it when destroyed.
+    template <typename... Args, typename F>
+    Subscription subscribe(std::string eventName, F &&newFunc);
+
+    // Register a function that is called with a reference to owner as its first argument, for as long as owner is alive.
+    // Each call locks owner and holds the reference until it returns, so owner may be destroyed concurrently with emits.
+    template <typename... Args, typename T, typename F>
+    size_t onWeak(std::string eventName, const std::weak_ptr<T> &owner, F &&newFunc);
+
+    template <typename... Args, typename T, typename F>
+    size_t onWeak(std::string eventName, const std::shared_ptr<T> &owner, F &&newFunc)
+    {
+        return onWeak<Args...>(std::move(eventName), std::weak_ptr<T>(owner), std::forward<F>(newFunc));
+    }
+
+    // Register a function on behalf of owner. It is unregistered by offAll(owner) or when owner is destroyed.
+    template <typename... Args, typename F>
+    size_t on(EventOwner &owner, std::string eventName, F &&newFunc);
+
+    // Register a function that is unregistered as soon as it has been called once.
+    // Returns its ID, which can be passed to off() to cancel it before it fires.
+    template <typename... Args, typename F>
+    size_t once(std::string eventName, F &&newFunc);
+
+    // Register a function that is called for one emit in rate, picked as selected by mode. Returns its ID.
+    template <typename... Args, typename F>
+    size_t onSampled(std::string eventName, SamplingMode mode, uint32_t rate, F &&newFunc);
+
+    // Unregister a function by the ID returned when it was registered. The template arguments are not needed: IDs are
+    // unique across all signatures of an event.
+    template <typename... Args>
+    void off(std::string eventName, size_t id);
+
+    // Unregister every function registered on behalf of owner.
+    void offAll(EventOwner &owner);
+
+    // Wrap every call of the functions registered from now on, for any event. Interceptors added first run outermost.
+    // Functions registered before the interceptor was added are not intercepted by it.
+    void addInterceptor(EventInterceptor interceptor);
+
+    // Wrap every call of the functions registered from now on for an event, with any signature. Functions registered
+    // before the interceptor was added are not intercepted by it. Event interceptors run inside the global ones.
+    void addInterceptor(const std::string &eventName, EventInterceptor interceptor);
+
+    // Compact every function vector, release spare capacity and remove events that have no functions left.
+    void compact();
+
+    // Report the memory held by the registry.
+    EventMemoryUsage memoryUsage();
+
+    // List every registered event name and signature with its number of functions. Reads the event index, not the
+    // registry, so it never waits for registration or emits.
+    std::vector<EventInfo> listEvents() const;
+
+    // Number of functions registered for an event name, over all its signatures.
+    size_t handlerCount(const std::string &eventName) const;
+
+    // Allow only one signature per event name. While enabled, registering a function or resolving a handle with a
+    // signature other than the one already registered under the name throws std::invalid_argument.
+    void setStrictSignatures(bool enabled);
+
+    // Number of functions and of event signatures registered in the manager.
+    size_t totalHandlers() const { return registryFunctionCount.load(std::memory_order_relaxed); }
+    size_t eventCount() const { return registryEventCount.load(std::memory_order_relaxed); }
+
+    // Emit an event with the specified name and pass arguments to the registered functions.
+    template <typename... Args>
+    void emitEvent(std::string eventName, Args... args);
+
+    // Emit an event to the functions registered with non-const reference arguments, passing the caller's objects by
+    // reference instead of copying them. The functions run in registration order and may modify the payload in turn.
+    template <typename... Args>
+    void emitInPlace(std::string eventName, Args &...payload);
+
+    // Resolve an event name and signature to a handle, registering the event if needed.
+    template <typename... Args>
+    EventHandle<Args...> handle(std::string eventName);
+
+    // Emit an event through a handle. No lookup, lock or signature check is done. A handle of non-const reference
+    // types, such as EventHandle<AudioBlock &>, passes the payload in place like emitInPlace().
+    template <typename... Args>
+    void emitEvent(const EventHandle<Args...> &eventHandle, NormalizedArgument<Args>... args);
+
+    // Append an event to the calling thread's buffer, to be emitted with the rest of the buffer when it is flushed, by
+    // the calling thread, the flush thread or a caller of flushAll(). Events buffered by one thread are emitted in order,
+    // but not in order with its direct emits. Arguments are copied.
+    template <typename... Args>
+    void emitBuffered(std::string eventName, Args... args);
+
+    // Emit the events buffered by the calling thread now. If another thread is flushing the buffer, wait until it is
+    // done, so that every event buffered before the call has been emitted when it returns. Called from a function being
+    // flushed from the same buffer, it returns at once and the ongoing flush emits the events. Returns the number of
+    // events flushed by this call.
+    size_t flush();
+
+    // Emit the events buffered by every thread, on the calling thread. Buffers that another thread is flushing are left
+    // to it without waiting. Returns the number of events flushed by this call.
+    size_t flushAll();
+
+    // Set when emitBuffered() flushes. Buffers left by exiting threads are flushed by the flush thread.
+    void setEmitBufferPolicy(const EmitBufferPolicy &policy);
+
+    // Queue an event to be emitted by the next call to dispatchPending(). Arguments are copied.
+    template <typename... Args>
+    void enqueueEvent(std::string eventName, Args... args);
+
+    // Queue an event that is discarded instead of dispatched if it is still pending at the deadline.
+    template <typename... Args>
+    void enqueueEventUntil(std::chrono::steady_clock::time_point deadline, std::string eventName, Args... args);
+
+    // Emit every queued event, highest priority first and in queue order within a priority.
+    // Returns the number of events dispatched.
+    size_t dispatchPending();
+
+    // Set the priority used when events with the specified name are queued. The default is EventPriority::Normal.
+    void setEventPriority(const std::string &eventName, EventPriority priority);
+
+    // When enabled, queuing an event replaces its pending instance (if any) instead of adding another one.
+    void setEventConflation(const std::string &eventName, bool conflate);
+
+    // Set the limits applied to queued events.
+    void setSheddingPolicy(const SheddingPolicy &policy);
+
+    // When enabled, pending events of each priority are dispatched earliest deadline first instead of in queue order.
+    // Events without a deadline go after those with one.
+    void setDeadlineOrdering(bool enabled);
+
+    // Return the counters of queued events that were dropped or conflated.
+    SheddingStats sheddingStats() const;
+
+#ifdef __linux__
+    // File descriptor that becomes readable while queued events are pending. It is signalled once per burst of
+    // enqueueEvent() calls, not once per event, and is reset by dispatchPending().
+    int pendingEventFd();
+#endif
+
+    // Wait until queued events are pending or the timeout expires, then dispatch them.
+    // Returns the number of events dispatched. Intended for a single consumer thread.
+    size_t waitAndDispatch(std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max());
+
+    // Select how waitAndDispatch() waits. The default is WaitStrategy::Adaptive.
+    void setWaitStrategy(WaitStrategy strategy) { waitStrategy.store(strategy, std::memory_order_relaxed); }
+
+    // Time every function call and flag, and optionally offload, functions that exceed the budget on average.
+    void setSlowHandlerPolicy(const SlowHandlerPolicy &policy);
+
+    // Number of functions flagged as slow.
+    uint64_t slowHandlerCount() const { return slowHandlers.load(std::memory_order_relaxed); }
+
+    // Number of calls of offloaded functions made inline because SlowHandlerPolicy::maxQueuedCalls were queued.
+    uint64_t offloadOverflowCount() const { return offloadOverflows.load(std::memory_order_relaxed); }
+
+    // Read the hardware performance counters around every function call and sum them per function. Returns false, and
+    // leaves profiling off, if the counters cannot be opened (non-Linux systems, or perf_event_paranoid too strict).
+    bool setHandlerProfiling(bool enabled);
+
+    // Return the counters summed per function, most cycles first.
+    std::vector<HandlerProfile> handlerProfiles() const;
+
+    // Format handlerProfiles() as a table with per-call averages.
+    std::string handlerProfileReport() const;
+
+    // Discard the counters summed so far.
+    void clearHandlerProfiles();
+
+    // Count emits per event name and calls per function in fixed memory, keeping the most frequent ones.
+    void setHeavyHitterTracking(bool enabled);
+
+    // Return up to count of the most emitted event names, and of the most called functions (as "name#id").
+    std::vector<HeavyHitter> topEvents(size_t count = 50) const;
+    std::vector<HeavyHitter> topHandlers(size_t count = 50) const;
+
+    // Restart the counts of setHeavyHitterTracking().
+    void resetHeavyHitters();
+
+    // Let emits read a replica of each function table local to the NUMA node they run on. Only worthwhile when
+    // numaNodeCount() is above one.
+    void setNumaReplication(bool enabled) { numaReplication.store(enabled, std::memory_order_relaxed); }
+
+    // Number of NUMA nodes of the host, or 1 if it cannot be determined.
+    static size_t numaNodeCount();
+
+private:
+    // Private constructor.
+    EventManager() = default;
+    ~EventManager();
+
+    // Delete copy constructor and copy assignment operator.
+    EventManager(const EventManager &) = delete;
+    EventManager &operator=(const EventManager &) = delete;
+
+    friend class Subscription;
+    template <typename... Args>
+    friend class EventHandle;
+
+    // Drop the count of a handle that is being destroyed, and reclaim its event if that was the last handle and the
+    // event has no functions.
+    void releaseHandle(BaseFunctionVector &functions);
+
+    // Remove a function and reclaim its event if it was the last one. Takes the locks itself; the caller keeps the
+    // vector alive.
+    void removeFunction(BaseFunctionVector &functions, size_t id);
+
+    // Remove the event of an empty function vector from functionsMap, retiring the registry's reference to the vector.
+    // functionsMapMutex must be held exclusively.
+    void reclaimIfEmpty(BaseFunctionVector &functions);
+
+    // Drop the reference a reclaimed event held in functionsMap, once it has passed through the EpochDomain.
+    static void releaseRegistryReference(void *functions);
+
+    // Reclaim a vector that may have become empty, taking functionsMapMutex exclusively only if it looks reclaimable.
+    // No lock may be held; the caller keeps the vector alive.
+    void reclaimIfEmptyUnlocked(BaseFunctionVector &functions);
+
+    // Find or create the function vector of an event with the given signature. functionsMapMutex must be held
+    // exclusively.
+    template <typename... Args>
+    DerivedFunctionVector<Args...> *findOrCreateFunctions(const std::string &eventName,
+                                                          VectorRef<BaseFunctionVector> *holder = nullptr);
+
+    // Call the functions of a vector. The caller holds an EpochDomain::Guard, which keeps the vector and what it lists
+    // from being freed.
+    template <typename... Stored, typename... Args>
+    void callFunctions(DerivedFunctionVector<Stored...> &functionVector, Args &...args);
+
+    // Add a function to the vector of the specified event, creating the vector if needed.
+    // Args are the normalized argument types.
+    template <typename... Args>
+    std::pair<VectorRef<BaseFunctionVector>, size_t> addFunction(std::string eventName, FunctionType<Args...> function,
+                                                                       std::weak_ptr<void> owner, bool ownerTracked,
+                                                                       EventOwner *eventOwner = nullptr, bool once = false,
+                                                                       SamplingMode samplingMode = SamplingMode::EveryNth,
+                                                                       uint32_t sampleRate = 1);
+
+    // Decide whether an emit calls a sampled function.
+    template <typename... Args>
+    static bool sampled(FunctionEntry<Args...> &entry);
+
+    // Cheap per-thread pseudo-random numbers for SamplingMode::Random.
+    static uint32_t sampleRandom();
+
+    // The hardware counters of one thread, opened as a group so that one read() returns all of them.
+    struct HardwareCounters
+    {
+        static constexpr size_t kCount = 4;
+
+        HardwareCounters();
+        ~HardwareCounters();
+
+        // Read cycles, instructions, cache misses and branch misses. Returns false if the counters are not available.
+        bool read(uint64_t (&values)[kCount]) const;
+
+        int fds[kCount] = {-1, -1, -1, -1};
+        bool available = false;
+    };
+
+    // The counters of the calling thread, opened on first use.
+    static const HardwareCounters &threadHardwareCounters();
+
+    // Call a function between two reads of the hardware counters and add the difference to its profile.
+    template <typename... Stored, typename... Args>
+    void callProfiled(const BaseFunctionVector &functionVector, FunctionEntry<Stored...> &entry, Args &...args);
+
+    // The counters summed by one thread. Its mutex is only contended while handlerProfiles() merges them.
+    struct ProfileShard
+    {
+        std::mutex mutex;
+        std::unordered_map<size_t, HandlerProfile> profilesById;
+    };
+
+    // Return the calling thread's shard, registering it on first use. The thread merges it into profilesById on exit.
+    ProfileShard &localProfileShard();
+
+    // Add the counts of profile to total.
+    static void addProfile(HandlerProfile &total, const HandlerProfile &profile);
+
+    // Shards of the threads that have profiled calls, and the counters of those that exited. Guarded by profilesMutex.
+    std::vector<ProfileShard *> profileShards;
+    std::unordered_map<size_t, HandlerProfile> profilesById;
+    mutable std::mutex profilesMutex;
+
+    // Sketches of setHeavyHitterTracking(), allocated when it is first enabled and kept until destruction so that
+    // emits can use them without a lock.
+    std::unique_ptr<HeavyHitterSketch> eventHitters;
+    std::unique_ptr<HeavyHitterSketch> handlerHitters;
+    mutable std::mutex heavyHitterMutex;
+
+    // Node of the CPU the calling thread runs on, below kMaxNumaNodes.
+    static size_t currentNumaNode();
+
+    // Node of each CPU, read once from sysfs.
+    static const std::vector<uint8_t> &numaNodeOfCpu();
+
+    // Call a function inline, timing it, or hand it to the offload workers once it has been offloaded.
+    template <typename... Stored, typename... Args>
+    void callTimed(BaseFunctionVector &functionVector, FunctionEntry<Stored...> &entry, std::chrono::nanoseconds budget,
+                   bool profile, Args &...args);
+
+    // Queue a call of a function to the offload workers with a copy of the arguments, or call it inline if the queue is
+    // full.
+    template <typename... Stored, typename... Args>
+    void offloadCall(BaseFunctionVector &functionVector, FunctionEntry<Stored...> &entry, Args &...args);
+
+    template <typename... Stored, typename Tuple, size_t... Index>
+    static void callWithTuple(FunctionEntry<Stored...> &entry, Tuple &arguments, std::index_sequence<Index...>);
+
+    // Queue a task to the offload workers, starting them if needed. Must be called inside an EpochDomain::Guard, whose
+    // epoch the task's batch holds until the task has run. Returns false, without queuing, if the queue is full.
+    bool submitOffloadTask(std::function<void()> task);
+
+    std::atomic<uint64_t> slowHandlers{0};
+    std::atomic<uint64_t> offloadOverflows{0};
+    SlowHandlerPolicy slowHandlerPolicy;
+    std::mutex slowHandlerMutex;
+
+    // Queued calls share the epoch pin of a batch instead of pinning one each. A batch collects the calls queued until a
+    // worker takes the first of them, and releases its pin once all of them have run.
+    struct OffloadBatch
+    {
+        EpochDomain::Record *pin;
+        size_t pending = 0;
+    };
+
+    struct OffloadTask
+    {
+        std::function<void()> call;
+        OffloadBatch *batch;
+    };
+
+    // Guarded by offloadMutex.
+    std::vector<std::thread> offloadWorkers;
+    std::deque<OffloadTask> offloadTasks;
+    OffloadBatch *openOffloadBatch = nullptr;
+    size_t offloadQueueLimit = 1024;
+    alignas(kCacheLineSize) std::mutex offloadMutex;
+    std::condition_variable offloadReady;
+    bool offloadStopping = false;
+
+    // An event appended by emitBuffered(). Its function vector is looked up when its buffer is flushed.
+    struct BufferedEmit
+    {
+        std::string eventName;
+        const std::type_info *signature;
+        std::function<void(BaseFunctionVector &)> emit;
+    };
+
+    // The events buffered by one thread. Its mutex is only contended when another thread flushes it.
+    struct EmitBuffer
+    {
+        std::mutex mutex;
+        std::vector<BufferedEmit> events;
+        std::chrono::steady_clock::time_point oldest;
+        // Set while a thread flushes the buffer. That thread emits the events appended meanwhile too, and other threads
+        // leave the buffer to it, which keeps the events in order. flush() waits on flushDone for it to be cleared.
+        bool flushing = false;
+        std::thread::id flushingThread;
+        std::condition_variable flushDone;
+        // Set when the owning thread exits. Guarded by emitBuffersMutex.
+        bool orphaned = false;
+    };
+
+    // Return the calling thread's buffer, registering it on first use. When the thread exits, the flush thread emits what
+    // is left in it and unregisters it.
+    EmitBuffer &localEmitBuffer();
+
+    // Take the events of a buffer and emit them until it stays empty, then give the emptied storage back to the buffer.
+    // If another thread is flushing it, wait for that flush to finish if wait is set, or else return 0 at once.
+    size_t flushEmitBuffer(EmitBuffer &buffer, bool wait = false);
+
+    // Body of the flush thread: flush and drop the buffers of exited threads, flush the buffers whose oldest event is
+    // due, sleeping until the next one is, and park while neither kind is left. Flushes every buffer before it stops.
+    void runEmitFlusher();
+
+    // Emit a batch of buffered events under one epoch guard, looking up each run of the same event once.
+    size_t dispatchBuffered(std::vector<BufferedEmit> &events);
+
+    // Buffers of all threads that have called emitBuffered(), shared with the threads so that flushes outside
+    // emitBuffersMutex keep them alive.
+    std::vector<std::shared_ptr<EmitBuffer>> emitBuffers;
+    std::mutex emitBuffersMutex;
+    // Started with the first buffer and stopped by the destructor. Guarded by emitBuffersMutex.
+    std::thread emitFlusher;
+    std::condition_variable emitFlusherWake;
+    bool emitFlusherStopping = false;
+    // Set by the flush thread before it parks. An emit that makes a buffer non-empty clears it and wakes the thread.
+    std::atomic<bool> emitFlusherParked{false};
+
+    // Settings read by every emit and written only by their setters, on a cache line of their own.
+    alignas(kCacheLineSize) std::atomic<bool> handlerProfiling{false};
+    std::atomic<bool> heavyHitterTracking{false};
+    std::atomic<bool> numaReplication{false};
+    std::atomic<bool> offloadSlowHandlers{false};
+    // Average call time above which a function is slow, in nanoseconds, or zero when timing is off.
+    std::atomic<int64_t> slowHandlerBudget{0};
+    // EmitBufferPolicy, read by emitBuffered().
+    std::atomic<size_t> emitBufferMaxEvents{64};
+    std::atomic<int64_t> emitBufferMaxDelay{1000000};
+
+    // Reclaims what emits may still be reading. Emits announce themselves here instead of on the vectors they iterate.
+    EpochDomain epochs;
+
+    // A map that associates event names and signatures with their respective function vectors. Registration and
+    // removal on events that already exist only share the mutex; creating and reclaiming events takes it exclusively.
+    // Emits by name search eventLookup instead and take no lock. The mutex, which registration writes, the map root and
+    // the lookup root, which emits read, each get a line of their own.
+    alignas(kCacheLineSize) mutable std::shared_mutex functionsMapMutex;
+    alignas(kCacheLineSize) std::map<EventKey, VectorRef<BaseFunctionVector>, EventKeyLess> functionsMap;
+    // The vectors of functionsMap, indexed for emits. Changed together with the event index.
+    alignas(kCacheLineSize) EventLookup eventLookup{epochs};
+    // ID of the next registered function, unique across all function vectors.
+    std::atomic<size_t> nextFunctionId{0};
+    // Set by setStrictSignatures(). Guarded by functionsMapMutex.
+    bool strictSignatures = false;
+
+    // Function vectors by event name, for introspection. Changed under both functionsMapMutex (exclusively) and
+    // eventIndexMutex when a vector is created or reclaimed; read under eventIndexMutex only.
+    std::unordered_map<std::string, std::vector<BaseFunctionVector *>> eventIndex;
+    mutable std::mutex eventIndexMutex;
+    std::atomic<size_t> registryFunctionCount{0};
+    std::atomic<size_t> registryEventCount{0};
+
+    // Add a new function vector to, or remove a reclaimed one from, the event index and eventLookup. functionsMapMutex
+    // must be held exclusively.
+    void indexEvent(BaseFunctionVector &functions);
+    void unindexEvent(BaseFunctionVector &functions);
+
+    // True if the event name is registered, but not with the signature. Backs the debug check of emits whose lookup
+    // missed, which may have raced with a registration of the signature itself.
+    bool registeredOnlyAsOther(const std::string &eventName, const std::type_info &signature) const;
+
+    // Demangled name of a function type.
+    static std::string signatureName(const std::type_info &signature);
+
+    // Demangled name of FunctionType<Args...>, computed on first use.
+    template <typename... Args>
+    static const std::string &signatureNameOf();
+
+    // Flatten the interceptors that apply to a function being registered for an event, or return nullptr if none do.
+    // functionsMapMutex must be held, shared or exclusively.
+    std::shared_ptr<const InterceptorChain> interceptorChain(const std::string &eventName) const;
+
+    // Call a function, through its interceptors if it has any.
+    template <typename... Stored, typename... Args>
+    static void invoke(FunctionEntry<Stored...> &entry, Args &...args);
+
+    // Run the interceptors of a function in order, each proceed() moving to the next, and call the function last.
+    template <typename... Stored, typename... Args>
+    static void callIntercepted(FunctionEntry<Stored...> &entry, Args &...args);
+
+    // Interceptors for every event and per event name. Guarded by functionsMapMutex.
+    std::vector<EventInterceptor> globalInterceptors;
+    std::map<std::string, std::vector<EventInterceptor>> eventInterceptors;
+    // Set by the first addInterceptor(), after which registrations look the interceptors up under the registry lock.
+    std::atomic<bool> interceptorsInstalled{false};
+
+    // An event queued by enqueueEvent(), waiting for dispatchPending().
+    struct PendingEvent
+    {
+        std::string eventName;
+        std::function<void()> emit;
+        std::chrono::steady_clock::time_point enqueued;
+        // time_point::max() when the event has no deadline.
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    // Per-event-name queuing options.
+    struct QueueOptions
+    {
+        EventPriority priority = EventPriority::Normal;
+        bool conflate = false;
+    };
+
+    // Add an event to its priority queue, applying conflation and depth shedding, and wake consumers.
+    void queuePendingEvent(std::string eventName, std::function<void()> emit,
+                           std::chrono::steady_clock::time_point deadline);
+
+    // Pending events, one FIFO per EventPriority. Element addresses are stable, which conflatedEvents relies on.
+    std::deque<PendingEvent> pendingEvents[SheddingStats::kPriorityCount];
+    size_t pendingCount = 0;
+    std::unordered_map<std::string, QueueOptions> queueOptions;
+    // The pending instance of each conflated event.
+    std::unordered_map<std::string, PendingEvent *> conflatedEvents;
+    SheddingPolicy sheddingPolicy;
+    SheddingStats shedding;
+    bool deadlineOrdering = false;
+    alignas(kCacheLineSize) mutable std::mutex pendingEventsMutex;
+
+#ifdef __linux__
+    // Set while pendingFd has been written and not yet drained, so a burst of enqueues costs one write.
+    std::atomic<bool> pendingSignalled{false};
+    std::atomic<int> pendingFd{-1};
+    std::mutex pendingFdMutex;
+#endif
+
+    // Spin hint for busy-wait loops.
+    static void cpuRelax();
+
+    // Park the calling thread until pendingSequence differs from expected or the timeout expires.
+    void parkConsumer(uint32_t expected, std::chrono::nanoseconds timeout);
+
+    // Bumped on every enqueue; doubles as the futex word consumers park on.
+    alignas(kCacheLineSize) std::atomic<uint32_t> pendingSequence{0};
+    // Value of pendingSequence when the queue was last taken by dispatchPending().
+    alignas(kCacheLineSize) std::atomic<uint32_t> consumedSequence{0};
+    // Number of consumers parked on pendingSequence, so enqueues only issue a wake syscall when someone sleeps.
+    std::atomic<uint32_t> parkedConsumers{0};
+
+    std::atomic<WaitStrategy> waitStrategy{WaitStrategy::Adaptive};
+    // Consumer-side estimate of the time between event arrivals, used to size the adaptive spin.
+    std::chrono::nanoseconds arrivalIntervalEwma{0};
+    std::chrono::steady_clock::time_point lastArrival{};
+};
+
+inline EventManager::~EventManager()
+{
+    {
+        std::lock_guard<std::mutex> lock(emitBuffersMutex);
+        emitFlusherStopping = true;
+    }
+    emitFlusherWake.notify_all();
+    if (emitFlusher.joinable())
+        emitFlusher.join();
+
+    {
+        std::lock_guard<std::mutex> lock(offloadMutex);
+        offloadStopping = true;
+    }
+    offloadReady.notify_all();
+    for (std::thread &worker : offloadWorkers)
+        worker.join();
+
+#ifdef __linux__
+    int fd = pendingFd.load();
+    if (fd >= 0)
+        ::close(fd);
+#endif
+}
+
+// Register a function or lambda function with a specific event name.
+template <typename... Args, typename F>
+size_t EventManager::on(std::string eventName, F &&newFunc)
+{
+    NormalizedFunctionType<Args...> func = std::forward<F>(newFunc);
+    return addFunction<NormalizedArgument<Args>...>(std::move(eventName), std::move(func), {}, false).second;
+}
+
+// Register a function and return a Subscription that unregisters it when destroyed.
+template <typename... Args, typename F>
+Subscription EventManager::subscribe(std::string eventName, F &&newFunc)
+{
+    NormalizedFunctionType<Args...> func = std::forward<F>(newFunc);
+    auto added = addFunction<NormalizedArgument<Args>...>(std::move(eventName), std::move(func), {}, false);
+    return Subscription(this, std::move(added.first), added.second);
+}
+
+// Register a function that receives a reference to owner for as long as owner is alive.
+template <typename... Args, typename T, typename F>
+size_t EventManager::onWeak(std::string eventName, const std::weak_ptr<T> &owner, F &&newFunc)
+{
+    // The raw pointer is taken once here; emits lock owner before every call, so object is alive whenever it is used.
+    T *object = owner.lock().get();
+    NormalizedFunctionType<Args...> func = [object, callback = std::forward<F>(newFunc)](NormalizedArgument<Args>... args) mutable
+    { callback(*object, args...); };
+    return addFunction<NormalizedArgument<Args>...>(std::move(eventName), std::move(func), owner, true).second;
+}
+
+// Register a function on behalf of owner.
+template <typename... Args, typename F>
+size_t EventManager::on(EventOwner &owner, std::string eventName, F &&newFunc)
+{
+    NormalizedFunctionType<Args...> func = std::forward<F>(newFunc);
+    return addFunction<NormalizedArgument<Args>...>(std::move(eventName), std::move(func), {}, false, &owner).second;
+}
+
+// Register a function that is unregistered as soon as it has been called once.
+template <typename... Args, typename F>
+size_t EventManager::once(std::string eventName, F &&newFunc)
+{
+    NormalizedFunctionType<Args...> func = std::forward<F>(newFunc);
+    return addFunction<NormalizedArgument<Args>...>(std::move(eventName), std::move(func), {}, false, nullptr, true).second;
+}
+
+// Register a function that is called for a sample of the emits.
+template <typename... Args, typename F>
+size_t EventManager::onSampled(std::string eventName, SamplingMode mode, uint32_t rate, F &&newFunc)
+{
+    NormalizedFunctionType<Args...> func = std::forward<F>(newFunc);
+    return addFunction<NormalizedArgument<Args>...>(std::move(eventName), std::move(func), {}, false, nullptr, false, mode, rate)
+        .second;
+}
+
+// Add a function to the vector of the specified event, creating the vector if needed.
+template <typename... Args>
+std::pair<VectorRef<BaseFunctionVector>, size_t> EventManager::addFunction(std::string eventName, FunctionType<Args...> function,
+                                                                                 std::weak_ptr<void> owner, bool ownerTracked,
+                                                                                 EventOwner *eventOwner, bool once,
+                                                                                 SamplingMode samplingMode, uint32_t sampleRate)
+{
+    using Vector = DerivedFunctionVector<Args...>;
+    size_t id = nextFunctionId.fetch_add(1, std::memory_order_relaxed);
+
+    // Registering on an event that already exists finds it the way emits do and appends without any lock, so that
+    // registrations on the same event do not wait for each other and write nothing shared but the table's counters.
+    // Interceptors are flattened under the registry lock, so while any are installed registrations take the locked
+    // paths below, as do functions with an EventOwner, since the owner's list links functions of several events.
+    if (eventOwner == nullptr && !interceptorsInstalled.load(std::memory_order_acquire))
+    {
+        auto entry = Vector::makeEntry(id, std::move(function), nullptr, std::move(owner), ownerTracked, once, samplingMode,
+                                       sampleRate);
+        {
+            // The vector and its table stay allocated until the guard is released, even if the event is reclaimed.
+            EpochDomain::Guard guard(epochs);
+            auto *functionVector = static_cast<Vector *>(
+                eventLookup.find(eventName, std::hash<std::string>()(eventName), typeid(FunctionType<Args...>)));
+            if (functionVector != nullptr && functionVector->tryAppend(entry))
+                return {VectorRef<BaseFunctionVector>(functionVector), id};
+        }
+
+        // The event does not exist yet, is being reclaimed, or its table is full.
+        std::shared_lock<std::shared_mutex> lock(functionsMapMutex);
+        auto itr = functionsMap.find(EventKey{eventName, typeid(FunctionType<Args...>)});
+        if (itr != functionsMap.end())
+        {
+            auto *functionVector = static_cast<Vector *>(itr->second.get());
+            entry->interceptors = interceptorChain(eventName);
+            std::lock_guard<std::mutex> functionsLock(functionVector->functionsMutex);
+            functionVector->add(std::move(entry));
+            return {itr->second, id};
+        }
+        function = std::move(entry->function);
+        owner = std::move(entry->owner);
+    }
+
+    std::lock_guard<std::shared_mutex> lock(functionsMapMutex);
+    VectorRef<BaseFunctionVector> holder;
+    Vector *functionVector = findOrCreateFunctions<Args...>(eventName, &holder);
+    FunctionEntry<Args...> *entry = functionVector->add(Vector::makeEntry(id, std::move(function), interceptorChain(eventName),
+                                                                          std::move(owner), ownerTracked, once, samplingMode,
+                                                                          sampleRate));
+
+    // Push the function onto the front of its owner's list.
+    if (eventOwner != nullptr)
+    {
+        std::lock_guard<std::mutex> ownerLock(eventOwner->mutex);
+        OwnerLink *link = new OwnerLink{eventOwner, functionVector, entry->id};
+        link->next = eventOwner->head;
+        if (eventOwner->head != nullptr)
+            eventOwner->head->previous = link;
+        eventOwner->head = link;
+        ++eventOwner->count;
+        eventOwner->manager = this;
+        entry->ownerLink = link;
+    }
+    return {std::move(holder), entry->id};
+}
+
+// Flatten the global interceptors, then the interceptors of the event, into one array outermost first.
+inline std::shared_ptr<const InterceptorChain> EventManager::interceptorChain(const std::string &eventName) const
+{
+    if (globalInterceptors.empty() && eventInterceptors.empty())
+        return nullptr;
+    auto eventItr = eventInterceptors.find(eventName);
+    if (globalInterceptors.empty() && eventItr == eventInterceptors.end())
+        return nullptr;
+
+    auto chain = std::make_shared<InterceptorChain>();
+    chain->eventName = eventName;
+    chain->interceptors = globalInterceptors;
+    if (eventItr != eventInterceptors.end())
+        chain->interceptors.insert(chain->interceptors.end(), eventItr->second.begin(), eventItr->second.end());
+    return chain;
+}
+
+template <typename... Stored, typename... Args>
+void EventManager::invoke(FunctionEntry<Stored...> &entry, Args &...args)
+{
+    if (entry.interceptors == nullptr)
+        entry.function(args...);
+    else
+        callIntercepted(entry, args...);
+}
+
+// Walk the chain of a function. Each step passes the interceptor a proceed() that runs the next step, and the step
+// after the last interceptor calls the function. The steps and arguments stay on the stack of the call, so no
+// allocation or std::function other than the interceptors themselves is involved.
+template <typename... Stored, typename... Args>
+void EventManager::callIntercepted(FunctionEntry<Stored...> &entry, Args &...args)
+{
+    auto call = [&]()
+    { entry.function(args...); };
+    using Call = decltype(call);
+
+    struct Step
+    {
+        const InterceptorChain &chain;
+        size_t functionId;
+        size_t index;
+        Call &call;
+
+        static void run(void *context)
+        {
+            const Step &step = *static_cast<const Step *>(context);
+            if (step.index == step.chain.interceptors.size())
+            {
+                step.call();
+                return;
+            }
+            Step next{step.chain, step.functionId, step.index + 1, step.call};
+            step.chain.interceptors[step.index](InterceptedCall{step.chain.eventName, step.functionId, &Step::run, &next});
+        }
+    };
+
+    Step first{*entry.interceptors, entry.id, 0, call};
+    Step::run(&first);
+}
+
+// Find or create the function vector of an event with the given signature.
+template <typename... Args>
+DerivedFunctionVector<Args...> *EventManager::findOrCreateFunctions(const std::string &eventName,
+                                                                    VectorRef<BaseFunctionVector> *holder)
+{
+    EventKey key{eventName, typeid(FunctionType<Args...>)};
+    auto itr = functionsMap.find(key);
+
+    // If the event name has no vector with this signature, create one.
+    if (itr == functionsMap.end())
+    {
+        auto other = functionsMap.find(eventName);
+        if (strictSignatures && other != functionsMap.end())
+        {
+            throw std::invalid_argument("EventManager: event \"" + eventName + "\" is registered as " +
+                                        *other->second->signatureText + ", not " + signatureNameOf<Args...>());
+        }
+        itr = functionsMap.emplace(std::move(key), VectorRef<BaseFunctionVector>::adopt(new DerivedFunctionVector<Args...>)).first;
+        itr->second->eventKey = &itr->first;
+        itr->second->eventName = eventName;
+        itr->second->eventNameHash = std::hash<std::string>()(eventName);
+        itr->second->signature = &typeid(FunctionType<Args...>);
+        itr->second->signatureText = &signatureNameOf<Args...>();
+        itr->second->registryFunctionCount = &registryFunctionCount;
+        itr->second->epochs = &epochs;
+        indexEvent(*itr->second);
+    }
+
+    if (holder != nullptr)
+        *holder = itr->second;
+    return static_cast<DerivedFunctionVector<Args...> *>(itr->second.get());
+}
+
+// Resolve an event name to a handle, registering the event if needed. The handle is counted under the registry lock,
+// so the event cannot be reclaimed between the lookup and the count.
+template <typename... Args>
+EventHandle<Args...> EventManager::handle(std::string eventName)
+{
+    VectorRef<BaseFunctionVector> holder;
+    {
+        std::shared_lock<std::shared_mutex> lock(functionsMapMutex);
+        auto itr = functionsMap.find(EventKey{eventName, typeid(NormalizedFunctionType<Args...>)});
+        if (itr != functionsMap.end())
+        {
+            holder = itr->second;
+            holder->handleCount.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    if (holder == nullptr)
+    {
+        std::lock_guard<std::shared_mutex> lock(functionsMapMutex);
+        findOrCreateFunctions<NormalizedArgument<Args>...>(eventName, &holder);
+        holder->handleCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    using Vector = typename EventHandle<Args...>::Vector;
+    return EventHandle<Args...>(this, VectorRef<Vector>(static_cast<Vector *>(holder.get())));
+}
+
+// Method to remove a function with a specific event name and function ID.
+// The ID is looked up in the vector of every signature registered under the name.
+template <typename... Args>
+void EventManager::off(std::string eventName, size_t id)
+{
+    VectorRef<BaseFunctionVector> emptied;
+    {
+        std::shared_lock<std::shared_mutex> lock(functionsMapMutex);
+        auto range = functionsMap.equal_range(eventName);
+
+        for (auto itr = range.first; itr != range.second; ++itr)
+        {
+            BaseFunctionVector &functions = *itr->second;
+            std::lock_guard<std::mutex> functionsLock(functions.functionsMutex);
+            if (functions.remove(id))
+            {
+                // Keep the vector alive until it has been reclaimed outside the shared lock.
+                if (functions.functionCount.load(std::memory_order_relaxed) == 0)
+                    emptied = itr->second;
+                break;
+            }
+        }
+    }
+    if (emptied != nullptr)
+        reclaimIfEmptyUnlocked(*emptied);
+    epochs.collect();
+}
+
+// Remove a function and reclaim its event if it was the last one.
+inline void EventManager::removeFunction(BaseFunctionVector &functions, size_t id)
+{
+    {
+        std::shared_lock<std::shared_mutex> lock(functionsMapMutex);
+        std::lock_guard<std::mutex> functionsLock(functions.functionsMutex);
+        functions.remove(id);
+    }
+    reclaimIfEmptyUnlocked(functions);
+    epochs.collect();
+}
+
+// Reclaim a vector that may have become empty. The checks are repeated under the exclusive lock.
+inline void EventManager::reclaimIfEmptyUnlocked(BaseFunctionVector &functions)
+{
+    if (functions.functionCount.load(std::memory_order_relaxed) != 0 ||
+        functions.handleCount.load(std::memory_order_relaxed) != 0)
+        return;
+    std::lock_guard<std::shared_mutex> lock(functionsMapMutex);
+    reclaimIfEmpty(functions);
+}
+
+inline void EventManager::releaseHandle(BaseFunctionVector &functions)
+{
+    if (functions.handleCount.fetch_sub(1, std::memory_order_relaxed) != 1)
+        return;
+    reclaimIfEmptyUnlocked(functions);
+    epochs.collect();
+}
+
+template <typename... Args>
+void EventHandle<Args...>::releaseHandle()
+{
+    if (functions)
+        manager->releaseHandle(*functions);
+}
+
+// Remove the event of an empty function vector from functionsMap. Emits that are still iterating the vector keep it
+// alive through their epoch, so the registry's reference is retired rather than dropped.
+inline void EventManager::reclaimIfEmpty(BaseFunctionVector &functions)
+{
+    if (functions.functionCount.load(std::memory_order_relaxed) != 0 || functions.eventKey == nullptr ||
+        functions.handleCount.load(std::memory_order_relaxed) != 0 || !functions.markReclaimed())
+        return;
+    auto itr = functionsMap.find(*functions.eventKey);
+    unindexEvent(functions);
+    functions.eventKey = nullptr;
+    // Subscriptions may still hold the vector; it is freed with the last of them.
+    epochs.retire(itr->second.detach(), &releaseRegistryReference, 0);
+    functionsMap.erase(itr);
+}
+
+inline void EventManager::releaseRegistryReference(void *functions)
+{
+    BaseFunctionVector::releaseReference(static_cast<BaseFunctionVector *>(functions));
+}
+
+// Compact every function vector and remove events that have no functions left.
+inline void EventManager::compact()
+{
+    {
+        std::lock_guard<std::shared_mutex> lock(functionsMapMutex);
+        for (auto itr = functionsMap.begin(); itr != functionsMap.end();)
+        {
+            BaseFunctionVector &functions = *itr->second;
+            if (functions.functionCount.load(std::memory_order_relaxed) == 0 &&
+                functions.handleCount.load(std::memory_order_relaxed) == 0 && functions.markReclaimed())
+            {
+                unindexEvent(functions);
+                functions.eventKey = nullptr;
+                epochs.retire(itr->second.detach(), &releaseRegistryReference, 0);
+                itr = functionsMap.erase(itr);
+                continue;
+            }
+            functions.compact();
+            ++itr;
+        }
+    }
+    epochs.collect(true);
+}
+
+inline void EventManager::indexEvent(BaseFunctionVector &functions)
+{
+    eventLookup.insert(&functions);
+    std::lock_guard<std::mutex> lock(eventIndexMutex);
+    eventIndex[functions.eventName].push_back(&functions);
+    registryEventCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void EventManager::unindexEvent(BaseFunctionVector &functions)
+{
+    eventLookup.erase(&functions);
+    std::lock_guard<std::mutex> lock(eventIndexMutex);
+    auto itr = eventIndex.find(functions.eventName);
+    std::vector<BaseFunctionVector *> &signatures = itr->second;
+    signatures.erase(std::find(signatures.begin(), signatures.end(), &functions));
+    if (signatures.empty())
+        eventIndex.erase(itr);
+    registryEventCount.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// List every registered event from the event index. The vectors it lists stay alive while eventIndexMutex is held,
+// since they are unindexed before the registry drops them. The signatures were demangled when the vectors were created,
+// so the lock is only held while the names and signature strings are copied.
+inline std::vector<EventInfo> EventManager::listEvents() const
+{
+    std::vector<EventInfo> events;
+    std::lock_guard<std::mutex> lock(eventIndexMutex);
+    events.reserve(registryEventCount.load(std::memory_order_relaxed));
+    for (const auto &nameSignatures : eventIndex)
+    {
+        for (const BaseFunctionVector *functions : nameSignatures.second)
+        {
+            events.push_back({nameSignatures.first, *functions->signatureText,
+                              functions->functionCount.load(std::memory_order_relaxed)});
+        }
+    }
+    return events;
+}
+
+inline bool EventManager::registeredOnlyAsOther(const std::string &eventName, const std::type_info &signature) const
+{
+    std::shared_lock<std::shared_mutex> lock(functionsMapMutex);
+    return functionsMap.find(eventName) != functionsMap.end() &&
+           functionsMap.find(EventKey{eventName, signature}) == functionsMap.end();
+}
+
+inline size_t EventManager::handlerCount(const std::string &eventName) const
+{
+    std::lock_guard<std::mutex> lock(eventIndexMutex);
+    auto itr = eventIndex.find(eventName);
+    if (itr == eventIndex.end())
+        return 0;
+    size_t count = 0;
+    for (const BaseFunctionVector *functions : itr->second)
+        count += functions->functionCount.load(std::memory_order_relaxed);
+    return count;
+}
+
+inline std::string EventManager::signatureName(const std::type_info &signature)
+{
+#ifdef __GNUG__
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(signature.name(), nullptr, nullptr, &status);
+    if (status == 0 && demangled != nullptr)
+    {
+        std::string name(demangled);
+        std::free(demangled);
+        return name;
+    }
+#endif
+    return signature.name();
+}
+
+template <typename... Args>
+const std::string &EventManager::signatureNameOf()
+{
+    static const std::string name = signatureName(typeid(FunctionType<Args...>));
+    return name;
+}
+
+// Report the memory held by the registry.
+inline EventMemoryUsage EventManager::memoryUsage()
+{
+    // A std::map node holds the key/value pair plus parent, left and right links and a colour.
+    constexpr size_t mapNodeBytes = sizeof(std::pair<const EventKey, VectorRef<BaseFunctionVector>>) + 4 * sizeof(void *);
+    // Names longer than this live on the heap instead of inside the std::string.
+    const size_t smallStringCapacity = std::string().capacity();
+
+    std::lock_guard<std::shared_mutex> lock(functionsMapMutex);
+    EventMemoryUsage usage;
+    for (const auto &event : functionsMap)
+    {
+        ++usage.events;
+        usage.eventBytes += mapNodeBytes;
+        if (event.first.name.capacity() > smallStringCapacity)
+            usage.eventBytes += event.first.name.capacity() + 1;
+        event.second->addMemoryUsage(usage);
+    }
+    usage.eventBytes += eventLookup.bytes();
+    usage.functionBytes += epochs.pendingBytes();
+    return usage;
+}
+
+inline void EventManager::setStrictSignatures(bool enabled)
+{
+    std::lock_guard<std::shared_mutex> lock(functionsMapMutex);
+    strictSignatures = enabled;
+}
+
+// Add an interceptor for every event.
+inline void EventManager::addInterceptor(EventInterceptor interceptor)
+{
+    std::lock_guard<std::shared_mutex> lock(functionsMapMutex);
+    globalInterceptors.push_back(std::move(interceptor));
+    interceptorsInstalled.store(true, std::memory_order_release);
+}
+
+// Add an interceptor for one event.
+inline void EventManager::addInterceptor(const std::string &eventName, EventInterceptor interceptor)
+{
+    std::lock_guard<std::shared_mutex> lock(functionsMapMutex);
+    eventInterceptors[eventName].push_back(std::move(interceptor));
+    interceptorsInstalled.store(true, std::memory_order_release);
+}
+
+// Unregister every function registered on behalf of owner. Each removal unlinks the head of the owner's list. The
+// exclusive lock keeps every other thread out of the owner's functions, so their vectors need no locks of their own.
+inline void EventManager::offAll(EventOwner &owner)
+{
+    {
+        std::lock_guard<std::shared_mutex> lock(functionsMapMutex);
+        while (owner.head != nullptr)
+        {
+            BaseFunctionVector &functions = *owner.head->functions;
+            functions.remove(owner.head->id);
+            reclaimIfEmpty(functions);
+        }
+    }
+    epochs.collect();
+}
+
+// Called with the lock of the vector that held the function.
+inline void OwnerLink::unlinkAndDelete()
+{
+    std::lock_guard<std::mutex> lock(owner->mutex);
+    if (previous != nullptr)
+        previous->next = next;
+    else
+        owner->head = next;
+    if (next != nullptr)
+        next->previous = previous;
+    --owner->count;
+    delete this;
+}
+
+inline EventOwner::~EventOwner()
+{
+    if (manager != nullptr)
+        manager->offAll(*this);
+}
+
+// Emit an event with the specified name and pass arguments to the registered functions.
+// The registered functions are called without holding functionsMapMutex, so they may register, unregister and emit
+// freely. Functions registered during the emit are not called by it; functions unregistered during it are skipped from
+// then on. Emits of one event from several threads call its functions concurrently.
+template <typename... Args>
+void EventManager::emitEvent(std::string eventName, Args... args)
+{
+    using Vector = DerivedFunctionVector<NormalizedArgument<Args>...>;
+    // Counted before the lookup, so that emits nobody listens to show up too.
+    if (heavyHitterTracking.load(std::memory_order_acquire))
+    {
+        eventHitters->record(std::hash<std::string>()(eventName), [&eventName]()
+                             { return eventName; });
+    }
+    // Announced before the lookup, so that a vector reclaimed after it stays allocated until the emit is done.
+    EpochDomain::Guard guard(epochs);
+    BaseFunctionVector *functions =
+        eventLookup.find(eventName, std::hash<std::string>()(eventName), typeid(NormalizedFunctionType<Args...>));
+    if (functions == nullptr)
+    {
+        // Only debug builds pay for looking the name up again, under the registry lock.
+        assert(!registeredOnlyAsOther(eventName, typeid(NormalizedFunctionType<Args...>)) &&
+               "emitEvent() arguments match none of the signatures registered for the event");
+        return;
+    }
+    callFunctions(*static_cast<Vector *>(functions), args...);
+}
+
+// Emit an event to the functions registered with non-const reference arguments, without copying the payload.
+template <typename... Args>
+void EventManager::emitInPlace(std::string eventName, Args &...payload)
+{
+    emitEvent<Args &...>(std::move(eventName), payload...);
+}
+
+// Emit an event through a handle.
+template <typename... Args>
+void EventManager::emitEvent(const EventHandle<Args...> &eventHandle, NormalizedArgument<Args>... args)
+{
+    if (heavyHitterTracking.load(std::memory_order_acquire))
+    {
+        const BaseFunctionVector &functions = *eventHandle.functions;
+        eventHitters->record(functions.eventNameHash, [&functions]()
+                             { return functions.eventName; });
+    }
+    EpochDomain::Guard guard(epochs);
+    callFunctions(*eventHandle.functions, args...);
+}
+
+// Call the functions of a vector under the caller's EpochDomain::Guard.
+template <typename... Stored, typename... Args>
+void EventManager::callFunctions(DerivedFunctionVector<Stored...> &functionVector, Args &...args)
+{
+    // Loaded after the epoch was announced, so a table replaced after this point is retired rather than freed.
+    FunctionTable<Stored...> *table = functionVector.table.load();
+    size_t size = table->size.load(std::memory_order_acquire);
+    // With a replica, the checks before each call read the node-local slots instead of the shared entries.
+    ReplicaSlot<Stored...> *slots = nullptr;
+    if (numaReplication.load(std::memory_order_relaxed) && size != 0)
+    {
+        FunctionReplica<Stored...> *replica = functionVector.replicaFor(currentNumaNode(), table, size, functionsMapMutex);
+        if (replica != nullptr)
+            slots = replica->slots.get();
+    }
+
+    // Execute all registered functions with the provided arguments, skipping tombstones.
+    bool profile = handlerProfiling.load(std::memory_order_relaxed);
+    std::chrono::nanoseconds budget(slowHandlerBudget.load(std::memory_order_relaxed));
+    bool trackHitters = heavyHitterTracking.load(std::memory_order_acquire);
+    bool sawExpired = false;
+    std::vector<size_t> firedOnce;
+    for (size_t position = 0; position < size; ++position)
+    {
+        FunctionEntry<Stored...> *entry;
+        bool once;
+        bool ownerTracked;
+        uint32_t sampleRate;
+        if (slots != nullptr)
+        {
+            ReplicaSlot<Stored...> &slot = slots[position];
+            if (!slot.alive.load(std::memory_order_relaxed))
+                continue;
+            entry = slot.entry;
+            once = slot.once;
+            ownerTracked = slot.ownerTracked;
+            sampleRate = slot.sampleRate;
+        }
+        else
+        {
+            entry = table->entries[position];
+            if (!entry->alive.load(std::memory_order_relaxed))
+                continue;
+            once = entry->once;
+            ownerTracked = entry->ownerTracked;
+            sampleRate = entry->sampleRate;
+        }
+        if (sampleRate != 1 && !sampled(*entry))
+            continue;
+        // Claiming the tombstone first guarantees a once() function runs exactly once, even under concurrent emits.
+        if (once)
+        {
+            if (!entry->alive.exchange(false, std::memory_order_relaxed))
+                continue;
+            firedOnce.push_back(entry->id);
+        }
+        // Functions registered with onWeak() keep their owner alive until they return, and are removed after the loop
+        // once it is gone.
+        std::shared_ptr<void> owner;
+        if (ownerTracked)
+        {
+            owner = entry->owner.lock();
+            if (owner == nullptr)
+            {
+                sawExpired = true;
+                continue;
+            }
+        }
+        if (trackHitters)
+        {
+            handlerHitters->record(std::hash<size_t>()(entry->id), [&functionVector, entry]()
+                                   { return functionVector.eventName + "#" + std::to_string(entry->id); });
+        }
+        if (budget.count() != 0)
+            callTimed(functionVector, *entry, budget, profile, args...);
+        else if (profile)
+            callProfiled(functionVector, *entry, args...);
+        else
+            invoke(*entry, args...);
+    }
+
+    if (sawExpired || !firedOnce.empty())
+    {
+        {
+            std::shared_lock<std::shared_mutex> lock(functionsMapMutex);
+            std::lock_guard<std::mutex> functionsLock(functionVector.functionsMutex);
+            for (size_t id : firedOnce)
+                functionVector.remove(id);
+            if (sawExpired)
+                functionVector.removeExpired();
+        }
+        reclaimIfEmptyUnlocked(functionVector);
+        epochs.collect();
+    }
+}
+
+// Call a function inline and update its moving average, weighting the new sample by 1/8. The first time the average
+// exceeds the budget the function is flagged, and offloaded if the policy asks for it and its arguments can be copied.
+// Functions whose arguments cannot be copied always run inline.
+template <typename... Stored, typename... Args>
+void EventManager::callTimed(BaseFunctionVector &functionVector, FunctionEntry<Stored...> &entry,
+                             std::chrono::nanoseconds budget, bool profile, Args &...args)
+{
+    if constexpr (Offloadable<Stored...>::value)
+    {
+        if (entry.offloaded.load(std::memory_order_relaxed) && offloadSlowHandlers.load(std::memory_order_relaxed))
+        {
+            offloadCall(functionVector, entry, args...);
+            return;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if (profile)
+        callProfiled(functionVector, entry, args...);
+    else
+        invoke(entry, args...);
+    int64_t sample = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    // Concurrent emits may lose an update to each other; the average only needs to be approximate.
+    int64_t average = entry.averageNanos.load(std::memory_order_relaxed);
+    average = average == 0 ? sample : average + (sample - average) / 8;
+    entry.averageNanos.store(average, std::memory_order_relaxed);
+    if (average <= budget.count() || entry.slow.exchange(true, std::memory_order_relaxed))
+        return;
+
+    slowHandlers.fetch_add(1, std::memory_order_relaxed);
+    if (Offloadable<Stored...>::value && offloadSlowHandlers.load(std::memory_order_relaxed))
+        entry.offloaded.store(true, std::memory_order_relaxed);
+    std::function<void(const std::string &, size_t, std::chrono::nanoseconds)> onSlowHandler;
+    {
+        std::lock_guard<std::mutex> lock(slowHandlerMutex);
+        onSlowHandler = slowHandlerPolicy.onSlowHandler;
+    }
+    if (onSlowHandler)
+        onSlowHandler(functionVector.eventName, entry.id, std::chrono::nanoseconds(average));
+}
+
+// Queue a call to the offload workers. The batch of the task pins the epoch of the emit until the task has run, so the
+// entry is not retired before then, and the task holds the vector so that the vector outlives it. The arguments are
+// copied into the task itself. When the queue is full the function is called inline, as it was before it was offloaded.
+template <typename... Stored, typename... Args>
+void EventManager::offloadCall(BaseFunctionVector &functionVector, FunctionEntry<Stored...> &entry, Args &...args)
+{
+    bool queued = submitOffloadTask([holder = VectorRef<BaseFunctionVector>(&functionVector), &entry,
+                                     arguments = std::tuple<typename std::decay<Stored>::type...>(args...)]() mutable
+                                    {
+                                        // The function may have been unregistered, or its onWeak() owner destroyed, while
+                                        // the call was queued.
+                                        if (!entry.alive.load(std::memory_order_relaxed) && !entry.once)
+                                            return;
+                                        std::shared_ptr<void> owner;
+                                        if (entry.ownerTracked && (owner = entry.owner.lock()) == nullptr)
+                                            return;
+                                        callWithTuple(entry, arguments, std::index_sequence_for<Stored...>()); });
+    if (!queued)
+    {
+        offloadOverflows.fetch_add(1, std::memory_order_relaxed);
+        invoke(entry, args...);
+    }
+}
+
+template <typename... Stored, typename Tuple, size_t... Index>
+void EventManager::callWithTuple(FunctionEntry<Stored...> &entry, Tuple &arguments, std::index_sequence<Index...>)
+{
+    invoke(entry, std::get<Index>(arguments)...);
+}
+
+// Call a function between two reads of the calling thread's hardware counters. The counters only count user space, so
+// the reads themselves are not included. Without counters only the calls are counted. The counts go to the calling
+// thread's shard, so profiled emits on different threads share no lock, and allocate only for a function's first call.
+template <typename... Stored, typename... Args>
+void EventManager::callProfiled(const BaseFunctionVector &functionVector, FunctionEntry<Stored...> &entry, Args &...args)
+{
+    const HardwareCounters &counters = threadHardwareCounters();
+    uint64_t before[HardwareCounters::kCount] = {};
+    uint64_t after[HardwareCounters::kCount] = {};
+    bool counted = counters.read(before);
+    invoke(entry, args...);
+    counted = counted && counters.read(after);
+
+    ProfileShard &shard = localProfileShard();
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    HandlerProfile &profile = shard.profilesById[entry.id];
+    if (profile.calls++ == 0)
+    {
+        profile.eventName = functionVector.eventName;
+        profile.functionId = entry.id;
+    }
+    if (counted)
+    {
+        profile.cycles += after[0] - before[0];
+        profile.instructions += after[1] - before[1];
+        profile.cacheMisses += after[2] - before[2];
+        profile.branchMisses += after[3] - before[3];
+    }
+}
+
+// Decide whether an emit calls a sampled function. Concurrent emits share the counter, so every Nth emit is counted
+// across threads.
+template <typename... Args>
+bool EventManager::sampled(FunctionEntry<Args...> &entry)
+{
+    if (entry.sampleRandomly)
+        return (static_cast<uint64_t>(sampleRandom()) * entry.sampleRate) >> 32 == 0;
+    return entry.sampleCounter.fetch_add(1, std::memory_order_relaxed) % entry.sampleRate == 0;
+}
+
+// Xorshift generator with one state per thread, seeded from the thread ID.
+inline uint32_t EventManager::sampleRandom()
+{
+    thread_local uint32_t state = static_cast<uint32_t>(std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+inline Subscription::Subscription(Subscription &&other) noexcept
+    : manager(other.manager), functions(std::move(other.functions)), id(other.id)
+{
+    other.functions = nullptr;
+}
+
+inline Subscription &Subscription::operator=(Subscription &&other) noexcept
+{
+    if (this != &other)
+    {
+        unsubscribe();
+        manager = other.manager;
+        functions = std::move(other.functions);
+        id = other.id;
+        other.functions = nullptr;
+    }
+    return *this;
+}
+
+// Unregister the function now. The Subscription holds the function vector itself, so no lookup is needed.
+inline void Subscription::unsubscribe()
+{
+    if (!functions)
+        return;
+    manager->removeFunction(*functions, id);
+    functions = nullptr;
+}
+
+// Keep the function registered after this token is destroyed.
+inline size_t Subscription::release()
+{
+    functions = nullptr;
+    return id;
+}
+
+// Append an event to the calling thread's buffer, flushing the buffer if it is full or its oldest event is due.
+template <typename... Args>
+void EventManager::emitBuffered(std::string eventName, Args... args)
+{
+    using Vector = DerivedFunctionVector<NormalizedArgument<Args>...>;
+    int64_t maxDelay = emitBufferMaxDelay.load(std::memory_order_relaxed);
+    EmitBuffer &buffer = localEmitBuffer();
+    bool due;
+    bool first;
+    {
+        std::lock_guard<std::mutex> lock(buffer.mutex);
+        // The clock is only read when a delay is set.
+        auto now = maxDelay != 0 ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+        first = buffer.events.empty();
+        if (first)
+            buffer.oldest = now;
+        buffer.events.push_back({std::move(eventName), &typeid(NormalizedFunctionType<Args...>),
+                                 [this, args...](BaseFunctionVector &functions)
+                                 { callFunctions(static_cast<Vector &>(functions), args...); }});
+        due = buffer.events.size() >= emitBufferMaxEvents.load(std::memory_order_relaxed) ||
+              (maxDelay != 0 && now - buffer.oldest >= std::chrono::nanoseconds(maxDelay));
+    }
+    if (due)
+        flushEmitBuffer(buffer);
+    // The flush thread parks only after finding every buffer empty under its lock, so an emit that filled a buffer
+    // after that sees the flag. Waking it under emitBuffersMutex keeps the wakeup from falling before its wait.
+    else if (first && maxDelay != 0 && emitFlusherParked.load(std::memory_order_seq_cst))
+    {
+        {
+            std::lock_guard<std::mutex> lock(emitBuffersMutex);
+            emitFlusherParked.store(false, std::memory_order_relaxed);
+        }
+        emitFlusherWake.notify_one();
+    }
+}
+
+inline size_t EventManager::flush()
+{
+    return flushEmitBuffer(localEmitBuffer(), true);
+}
+
+// Flush the buffers one by one, outside emitBuffersMutex, so that each is flushed by one thread at a time.
+inline size_t EventManager::flushAll()
+{
+    std::vector<std::shared_ptr<EmitBuffer>> buffers;
+    {
+        std::lock_guard<std::mutex> lock(emitBuffersMutex);
+        buffers = emitBuffers;
+    }
+    size_t flushed = 0;
+    for (const std::shared_ptr<EmitBuffer> &buffer : buffers)
+        flushed += flushEmitBuffer(*buffer);
+    return flushed;
+}
+
+inline void EventManager::setEmitBufferPolicy(const EmitBufferPolicy &policy)
+{
+    emitBufferMaxEvents.store(std::max<size_t>(policy.maxEvents, 1), std::memory_order_relaxed);
+    emitBufferMaxDelay.store(policy.maxDelay.count(), std::memory_order_relaxed);
+    // The flush thread may be parked with events buffered under the old policy.
+    {
+        std::lock_guard<std::mutex> lock(emitBuffersMutex);
+        emitFlusherParked.store(false, std::memory_order_relaxed);
+    }
+    emitFlusherWake.notify_one();
+}
+
+inline EventManager::EmitBuffer &EventManager::localEmitBuffer()
+{
+    // Hands the buffer of the thread over to the flush thread when the thread exits. Emitting from here is not safe:
+    // other thread_local state an emit relies on, such as the thread's epoch record, may already be destroyed.
+    struct Registration
+    {
+        EventManager *manager = nullptr;
+        std::shared_ptr<EmitBuffer> buffer;
+
+        ~Registration()
+        {
+            if (buffer == nullptr)
+                return;
+            {
+                std::lock_guard<std::mutex> lock(manager->emitBuffersMutex);
+                buffer->orphaned = true;
+                manager->emitFlusherParked.store(false, std::memory_order_relaxed);
+            }
+            manager->emitFlusherWake.notify_one();
+        }
+    };
+
+    thread_local Registration registration;
+    if (registration.buffer == nullptr)
+    {
+        registration.manager = this;
+        registration.buffer = std::make_shared<EmitBuffer>();
+        std::lock_guard<std::mutex> lock(emitBuffersMutex);
+        emitBuffers.push_back(registration.buffer);
+        if (!emitFlusher.joinable())
+            emitFlusher = std::thread([this]()
+                                      { runEmitFlusher(); });
+    }
+    return *registration.buffer;
+}
+
+inline size_t EventManager::flushEmitBuffer(EmitBuffer &buffer, bool wait)
+{
+    std::vector<BufferedEmit> events;
+    {
+        std::unique_lock<std::mutex> lock(buffer.mutex);
+        if (buffer.flushing)
+        {
+            // A thread flushing its own buffer from a function it is emitting would wait for itself.
+            if (!wait || buffer.flushingThread == std::this_thread::get_id())
+                return 0;
+            buffer.flushDone.wait(lock, [&buffer]()
+                                  { return !buffer.flushing; });
+        }
+        buffer.flushing = true;
+        buffer.flushingThread = std::this_thread::get_id();
+    }
+    size_t flushed = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(buffer.mutex);
+            if (buffer.events.empty())
+            {
+                // Give the emptied storage back for reuse.
+                events.clear();
+                buffer.events.swap(events);
+                buffer.flushing = false;
+                lock.unlock();
+                buffer.flushDone.notify_all();
+                return flushed;
+            }
+            events.clear();
+            events.swap(buffer.events);
+        }
+        // Functions may buffer more events meanwhile, even into this buffer; the loop emits them next.
+        flushed += dispatchBuffered(events);
+    }
+}
+
+inline void EventManager::runEmitFlusher()
+{
+    std::unique_lock<std::mutex> lock(emitBuffersMutex);
+    while (!emitFlusherStopping)
+    {
+        auto live = std::stable_partition(emitBuffers.begin(), emitBuffers.end(),
+                                          [](const std::shared_ptr<EmitBuffer> &buffer)
+                                          { return !buffer->orphaned; });
+        std::vector<std::shared_ptr<EmitBuffer>> orphans(live, emitBuffers.end());
+        emitBuffers.erase(live, emitBuffers.end());
+        std::vector<std::shared_ptr<EmitBuffer>> buffers = emitBuffers;
+        lock.unlock();
+
+        for (const std::shared_ptr<EmitBuffer> &buffer : orphans)
+            flushEmitBuffer(*buffer);
+
+        std::chrono::nanoseconds maxDelay(emitBufferMaxDelay.load(std::memory_order_relaxed));
+        auto now = std::chrono::steady_clock::now();
+        auto next = std::chrono::steady_clock::time_point::max();
+        for (const std::shared_ptr<EmitBuffer> &buffer : buffers)
+        {
+            if (maxDelay.count() == 0)
+                break;
+            std::chrono::steady_clock::time_point due;
+            {
+                std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+                if (buffer->events.empty())
+                    continue;
+                due = buffer->oldest + maxDelay;
+            }
+            if (due <= now)
+                flushEmitBuffer(*buffer);
+            else
+                next = std::min(next, due);
+        }
+
+        lock.lock();
+        if (emitFlusherStopping)
+            break;
+        if (next != std::chrono::steady_clock::time_point::max())
+        {
+            emitFlusherWake.wait_until(lock, next);
+            continue;
+        }
+        // Park, unless a buffer filled after the scan. Emits check the flag after appending, under the buffer's lock
+        // taken here after setting it, so either this check sees their event or they see the flag.
+        emitFlusherParked.store(true, std::memory_order_seq_cst);
+        bool pending = false;
+        bool timed = emitBufferMaxDelay.load(std::memory_order_relaxed) != 0;
+        for (const std::shared_ptr<EmitBuffer> &buffer : emitBuffers)
+        {
+            std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+            pending = pending || buffer->orphaned || (timed && !buffer->events.empty());
+        }
+        if (pending)
+        {
+            emitFlusherParked.store(false, std::memory_order_relaxed);
+            continue;
+        }
+        emitFlusherWake.wait(lock, [this]()
+                             { return !emitFlusherParked.load(std::memory_order_relaxed) || emitFlusherStopping; });
+    }
+    lock.unlock();
+    // The thread destroying the manager has handed its buffer over by now, and other buffers may still hold events.
+    flushAll();
+}
+
+// Emit a batch of buffered events. Consecutive events of the same name and signature share one lookup, and the epoch
+// guard keeps every vector looked up alive until the batch is done, even if its event is reclaimed meanwhile.
+inline size_t EventManager::dispatchBuffered(std::vector<BufferedEmit> &events)
+{
+    if (events.empty())
+        return 0;
+    EpochDomain::Guard guard(epochs);
+    std::vector<BaseFunctionVector *> targets(events.size(), nullptr);
+    for (size_t index = 0; index < events.size(); ++index)
+    {
+        BufferedEmit &event = events[index];
+        if (index != 0 && events[index - 1].signature == event.signature &&
+            events[index - 1].eventName == event.eventName)
+        {
+            targets[index] = targets[index - 1];
+            continue;
+        }
+        targets[index] = eventLookup.find(event.eventName, std::hash<std::string>()(event.eventName), *event.signature);
+        assert((targets[index] != nullptr || !registeredOnlyAsOther(event.eventName, *event.signature)) &&
+               "emitBuffered() arguments match none of the signatures registered for the event");
+    }
+
+    bool trackHitters = heavyHitterTracking.load(std::memory_order_acquire);
+    for (size_t index = 0; index < events.size(); ++index)
+    {
+        BufferedEmit &event = events[index];
+        if (trackHitters)
+        {
+            eventHitters->record(std::hash<std::string>()(event.eventName), [&event]()
+                                 { return event.eventName; });
+        }
+        if (targets[index] != nullptr)
+            event.emit(*targets[index]);
+    }
+    return events.size();
+}
+
+// Queue an event to be emitted by the next call to dispatchPending().
+template <typename... Args>
+void EventManager::enqueueEvent(std::string eventName, Args... args)
+{
+    std::function<void()> emit = [this, eventName, args...]()
+    { emitEvent<Args...>(eventName, args...); };
+    queuePendingEvent(std::move(eventName), std::move(emit), std::chrono::steady_clock::time_point::max());
+}
+
+// Queue an event that is discarded instead of dispatched if it is still pending at the deadline.
+template <typename... Args>
+void EventManager::enqueueEventUntil(std::chrono::steady_clock::time_point deadline, std::string eventName, Args... args)
+{
+    std::function<void()> emit = [this, eventName, args...]()
+    { emitEvent<Args...>(eventName, args...); };
+    queuePendingEvent(std::move(eventName), std::move(emit), deadline);
+}
+
+// Add an event to its priority queue, applying conflation and depth shedding, and wake consumers.
+inline void EventManager::queuePendingEvent(std::string eventName, std::function<void()> emit,
+                                            std::chrono::steady_clock::time_point deadline)
+{
+    {
+        std::lock_guard<std::mutex> lock(pendingEventsMutex);
+        auto now = std::chrono::steady_clock::now();
+        QueueOptions options;
+        auto optionsItr = queueOptions.find(eventName);
+        if (optionsItr != queueOptions.end())
+            options = optionsItr->second;
+        size_t priority = static_cast<size_t>(options.priority);
+
+        // A conflated event that is already pending takes the new arguments and keeps its place in the queue.
+        if (options.conflate)
+        {
+            auto conflatedItr = conflatedEvents.find(eventName);
+            if (conflatedItr != conflatedEvents.end())
+            {
+                conflatedItr->second->emit = std::move(emit);
+                conflatedItr->second->enqueued = now;
+                conflatedItr->second->deadline = deadline;
+                ++shedding.conflated[priority];
+                return;
+            }
+        }
+
+        if (sheddingPolicy.maxDepth != 0 && pendingCount >= sheddingPolicy.maxDepth)
+        {
+            // Make room by dropping the oldest event of the lowest sheddable priority up to the new one's, so that a queue
+            // full of events of one priority keeps the newest of them.
+            size_t limit = std::min(priority + 1, static_cast<size_t>(sheddingPolicy.protectedPriority));
+            size_t victim = 0;
+            while (victim < limit && pendingEvents[victim].empty())
+                ++victim;
+
+            if (victim < limit)
+            {
+                PendingEvent &oldest = pendingEvents[victim].front();
+                auto conflatedItr = conflatedEvents.find(oldest.eventName);
+                if (conflatedItr != conflatedEvents.end() && conflatedItr->second == &oldest)
+                    conflatedEvents.erase(conflatedItr);
+                pendingEvents[victim].pop_front();
+                --pendingCount;
+                ++shedding.droppedForDepth[victim];
+            }
+            else if (options.priority < sheddingPolicy.protectedPriority)
+            {
+                ++shedding.droppedForDepth[priority];
+                return;
+            }
+        }
+
+        pendingEvents[priority].push_back({eventName, std::move(emit), now, deadline});
+        ++pendingCount;
+        if (options.conflate)
+            conflatedEvents[eventName] = &pendingEvents[priority].back();
+        pendingSequence.fetch_add(1);
+    }
+
+    // Consumers in waitAndDispatch() that are still spinning see pendingSequence change on their own.
+    if (parkedConsumers.load() != 0)
+    {
+#ifdef __linux__
+        ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(&pendingSequence), FUTEX_WAKE_PRIVATE, INT_MAX,
+                  nullptr, nullptr, 0);
+#endif
+    }
+
+#ifdef __linux__
+    // Only the first enqueue after a dispatch writes to the eventfd.
+    int fd = pendingFd.load(std::memory_order_acquire);
+    if (fd >= 0 && !pendingSignalled.exchange(true))
+    {
+        uint64_t one = 1;
+        while (::write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        {
+        }
+    }
+#endif
+}
+
+// Emit every queued event in the order it was queued.
+inline size_t EventManager::dispatchPending()
+{
+#ifdef __linux__
+    // Drain the eventfd before taking the queue, so an enqueue racing with this call signals the fd again.
+    int fd = pendingFd.load(std::memory_order_acquire);
+    if (fd >= 0)
+    {
+        uint64_t count;
+        while (::read(fd, &count, sizeof(count)) < 0 && errno == EINTR)
+        {
+        }
+        pendingSignalled.store(false);
+    }
+#endif
+
+    std::deque<PendingEvent> events[SheddingStats::kPriorityCount];
+    SheddingPolicy policy;
+    bool byDeadline;
+    {
+        std::lock_guard<std::mutex> lock(pendingEventsMutex);
+        for (size_t priority = 0; priority < SheddingStats::kPriorityCount; ++priority)
+            events[priority].swap(pendingEvents[priority]);
+        pendingCount = 0;
+        conflatedEvents.clear();
+        policy = sheddingPolicy;
+        byDeadline = deadlineOrdering;
+        consumedSequence.store(pendingSequence.load(std::memory_order_relaxed), std::memory_order_release);
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    size_t dispatched = 0;
+    uint64_t expired[SheddingStats::kPriorityCount] = {};
+    uint64_t missedDeadline[SheddingStats::kPriorityCount] = {};
+    for (size_t priority = SheddingStats::kPriorityCount; priority-- > 0;)
+    {
+        if (byDeadline)
+            std::stable_sort(events[priority].begin(), events[priority].end(),
+                             [](const PendingEvent &a, const PendingEvent &b)
+                             { return a.deadline < b.deadline; });
+
+        bool sheddable = policy.maxAge.count() != 0 && priority < static_cast<size_t>(policy.protectedPriority);
+        for (auto &event : events[priority])
+        {
+            if (sheddable && now - event.enqueued > policy.maxAge)
+            {
+                ++expired[priority];
+                continue;
+            }
+            // Earlier handlers may have run long, so the clock is read again, but only for events with a deadline.
+            if (event.deadline != std::chrono::steady_clock::time_point::max() &&
+                std::chrono::steady_clock::now() > event.deadline)
+            {
+                ++missedDeadline[priority];
+                continue;
+            }
+            event.emit();
+            ++dispatched;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(pendingEventsMutex);
+    for (size_t priority = 0; priority < SheddingStats::kPriorityCount; ++priority)
+    {
+        shedding.droppedForAge[priority] += expired[priority];
+        shedding.droppedForDeadline[priority] += missedDeadline[priority];
+    }
+    return dispatched;
+}
+
+// Set the priority used when events with the specified name are queued.
+inline void EventManager::setEventPriority(const std::string &eventName, EventPriority priority)
+{
+    std::lock_guard<std::mutex> lock(pendingEventsMutex);
+    queueOptions[eventName].priority = priority;
+}
+
+// Enable or disable conflation of queued events with the specified name.
+inline void EventManager::setEventConflation(const std::string &eventName, bool conflate)
+{
+    std::lock_guard<std::mutex> lock(pendingEventsMutex);
+    queueOptions[eventName].conflate = conflate;
+    if (!conflate)
+        conflatedEvents.erase(eventName);
+}
+
+// Set the limits applied to queued events.
+inline void EventManager::setSheddingPolicy(const SheddingPolicy &policy)
+{
+    std::lock_guard<std::mutex> lock(pendingEventsMutex);
+    sheddingPolicy = policy;
+}
+
+// Enable or disable earliest-deadline-first dispatch of pending events.
+inline void EventManager::setDeadlineOrdering(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(pendingEventsMutex);
+    deadlineOrdering = enabled;
+}
+
+// Return the counters of queued events that were dropped or conflated.
+inline SheddingStats EventManager::sheddingStats() const
+{
+    std::lock_guard<std::mutex> lock(pendingEventsMutex);
+    return shedding;
+}
+
+inline void EventManager::cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+inline void EventManager::parkConsumer(uint32_t expected, std::chrono::nanoseconds timeout)
+{
+#ifdef __linux__
+    struct timespec relative;
+    struct timespec *relativeTimeout = nullptr;
+    if (timeout != std::chrono::nanoseconds::max())
+    {
+        relative.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+        relative.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+        relativeTimeout = &relative;
+    }
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(&pendingSequence), FUTEX_WAIT_PRIVATE, expected,
+              relativeTimeout, nullptr, 0);
+#else
+    (void)expected;
+    (void)timeout;
+    std::this_thread::yield();
+#endif
+}
+
+// Wait until queued events are pending or the timeout expires, then dispatch them.
+inline size_t EventManager::waitAndDispatch(std::chrono::nanoseconds timeout)
+{
+    using Clock = std::chrono::steady_clock;
+    // Spin no longer than this even when events arrive back to back; beyond it parking is cheaper.
+    constexpr std::chrono::nanoseconds maxSpin = std::chrono::microseconds(50);
+    constexpr std::chrono::nanoseconds minSpin = std::chrono::microseconds(1);
+    constexpr int yieldCount = 16;
+
+    auto idle = [this]()
+    { return pendingSequence.load(std::memory_order_acquire) == consumedSequence.load(std::memory_order_acquire); };
+
+    Clock::time_point start = Clock::now();
+    Clock::time_point deadline = timeout >= Clock::time_point::max() - start ? Clock::time_point::max() : start + timeout;
+    WaitStrategy strategy = waitStrategy.load(std::memory_order_relaxed);
+
+    if (idle() && strategy != WaitStrategy::Blocking)
+    {
+        // Spin phase. The clock is only read every few iterations to keep the loop tight.
+        std::chrono::nanoseconds spin = maxSpin;
+        if (strategy == WaitStrategy::Adaptive)
+            spin = arrivalIntervalEwma > std::chrono::nanoseconds::zero() && arrivalIntervalEwma < maxSpin
+                       ? std::min(2 * arrivalIntervalEwma, maxSpin)
+                       : minSpin;
+        Clock::time_point spinUntil = strategy == WaitStrategy::BusyPoll ? deadline : std::min(deadline, start + spin);
+        for (unsigned iteration = 1; idle(); ++iteration)
+        {
+            cpuRelax();
+            if (iteration % 64 == 0 && Clock::now() >= spinUntil)
+                break;
+        }
+
+        // Yield phase.
+        if (strategy == WaitStrategy::Adaptive)
+        {
+            for (int i = 0; i < yieldCount && idle(); ++i)
+                std::this_thread::yield();
+        }
+    }
+
+    // Park phase.
+    for (;;)
+    {
+        uint32_t current = pendingSequence.load(std::memory_order_acquire);
+        if (current != consumedSequence.load(std::memory_order_acquire))
+            break;
+        Clock::time_point now = Clock::now();
+        if (now >= deadline)
+            return 0;
+
+        parkedConsumers.fetch_add(1);
+        if (pendingSequence.load() == current)
+            parkConsumer(current, deadline == Clock::time_point::max() ? std::chrono::nanoseconds::max()
+                                                                        : std::chrono::nanoseconds(deadline - now));
+        parkedConsumers.fetch_sub(1);
+    }
+
+    // Learn how far apart events arrive, so the next spin covers a typical gap and no more.
+    Clock::time_point arrival = Clock::now();
+    if (lastArrival != Clock::time_point{})
+    {
+        std::chrono::nanoseconds interval = arrival - lastArrival;
+        arrivalIntervalEwma = arrivalIntervalEwma == std::chrono::nanoseconds::zero() ? interval
+                                                                                       : (arrivalIntervalEwma * 7 + interval) / 8;
+    }
+    lastArrival = arrival;
+
+    return dispatchPending();
+}
+
+inline void EventManager::setSlowHandlerPolicy(const SlowHandlerPolicy &policy)
+{
+    {
+        std::lock_guard<std::mutex> lock(slowHandlerMutex);
+        slowHandlerPolicy = policy;
+    }
+    {
+        std::lock_guard<std::mutex> lock(offloadMutex);
+        offloadQueueLimit = std::max<size_t>(policy.maxQueuedCalls, 1);
+    }
+    offloadSlowHandlers.store(policy.offload, std::memory_order_relaxed);
+    slowHandlerBudget.store(policy.budget.count(), std::memory_order_relaxed);
+}
+
+// Queue a task to the offload workers. Workers run tasks in queue order and exit once the manager is destroyed.
+inline bool EventManager::submitOffloadTask(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(offloadMutex);
+        if (offloadWorkers.empty())
+        {
+            size_t threads;
+            {
+                std::lock_guard<std::mutex> policyLock(slowHandlerMutex);
+                threads = std::max<size_t>(slowHandlerPolicy.offloadThreads, 1);
+            }
+            for (size_t worker = 0; worker < threads; ++worker)
+            {
+                offloadWorkers.emplace_back([this]()
+                                            {
+                                                std::unique_lock<std::mutex> workerLock(offloadMutex);
+                                                while (true)
+                                                {
+                                                    offloadReady.wait(workerLock, [this]()
+                                                                      { return offloadStopping || !offloadTasks.empty(); });
+                                                    if (offloadTasks.empty())
+                                                        return;
+                                                    OffloadTask next = std::move(offloadTasks.front());
+                                                    offloadTasks.pop_front();
+                                                    // Tasks queued from now on start a new batch, so this one ends.
+                                                    if (next.batch == openOffloadBatch)
+                                                        openOffloadBatch = nullptr;
+                                                    workerLock.unlock();
+                                                    next.call();
+                                                    next.call = nullptr;
+                                                    workerLock.lock();
+                                                    if (--next.batch->pending == 0)
+                                                    {
+                                                        EpochDomain::release(next.batch->pin);
+                                                        delete next.batch;
+                                                    }
+                                                } });
+            }
+        }
+        if (offloadTasks.size() >= offloadQueueLimit)
+            return false;
+        // The open batch keeps the oldest epoch of the emits that queued into it.
+        if (openOffloadBatch == nullptr)
+            openOffloadBatch = new OffloadBatch{epochs.pin()};
+        else
+            epochs.extendPin(openOffloadBatch->pin);
+        ++openOffloadBatch->pending;
+        offloadTasks.push_back({std::move(task), openOffloadBatch});
+    }
+    offloadReady.notify_one();
+    return true;
+}
+
+inline void EventManager::setHeavyHitterTracking(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(heavyHitterMutex);
+    if (enabled && eventHitters == nullptr)
+    {
+        eventHitters.reset(new HeavyHitterSketch());
+        handlerHitters.reset(new HeavyHitterSketch());
+    }
+    heavyHitterTracking.store(enabled, std::memory_order_release);
+}
+
+inline std::vector<HeavyHitter> EventManager::topEvents(size_t count) const
+{
+    std::lock_guard<std::mutex> lock(heavyHitterMutex);
+    return eventHitters != nullptr ? eventHitters->top(count) : std::vector<HeavyHitter>();
+}
+
+inline std::vector<HeavyHitter> EventManager::topHandlers(size_t count) const
+{
+    std::lock_guard<std::mutex> lock(heavyHitterMutex);
+    return handlerHitters != nullptr ? handlerHitters->top(count) : std::vector<HeavyHitter>();
+}
+
+inline void EventManager::resetHeavyHitters()
+{
+    std::lock_guard<std::mutex> lock(heavyHitterMutex);
+    if (eventHitters != nullptr)
+    {
+        eventHitters->reset();
+        handlerHitters->reset();
+    }
+}
+
+// Read the CPU list of every node from sysfs, e.g. "0-7,16-23" in /sys/devices/system/node/node0/cpulist.
+inline const std::vector<uint8_t> &EventManager::numaNodeOfCpu()
+{
+    static const std::vector<uint8_t> nodeOfCpu = []()
+    {
+        std::vector<uint8_t> nodes;
+#ifdef __linux__
+        for (unsigned node = 0; node < 64; ++node)
+        {
+            char path[64];
+            std::snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+            FILE *file = std::fopen(path, "r");
+            if (file == nullptr)
+                continue;
+            unsigned first, last;
+            while (std::fscanf(file, "%u", &first) == 1)
+            {
+                last = first;
+                if (std::fscanf(file, "-%u", &last) != 1)
+                    last = first;
+                if (nodes.size() <= last)
+                    nodes.resize(last + 1, 0);
+                for (unsigned cpu = first; cpu <= last; ++cpu)
+                    nodes[cpu] = static_cast<uint8_t>(node);
+                if (std::fgetc(file) != ',')
+                    break;
+            }
+            std::fclose(file);
+        }
+#endif
+        return nodes;
+    }();
+    return nodeOfCpu;
+}
+
+inline size_t EventManager::numaNodeCount()
+{
+    const std::vector<uint8_t> &nodes = numaNodeOfCpu();
+    return nodes.empty() ? 1 : *std::max_element(nodes.begin(), nodes.end()) + 1;
+}
+
+inline size_t EventManager::currentNumaNode()
+{
+#ifdef __linux__
+    const std::vector<uint8_t> &nodes = numaNodeOfCpu();
+    int cpu = ::sched_getcpu();
+    if (cpu >= 0 && static_cast<size_t>(cpu) < nodes.size())
+        return nodes[cpu] % kMaxNumaNodes;
+#endif
+    return 0;
+}
+
+inline bool EventManager::setHandlerProfiling(bool enabled)
+{
+    if (enabled && !threadHardwareCounters().available)
+        return false;
+    handlerProfiling.store(enabled, std::memory_order_relaxed);
+    return true;
+}
+
+// Merge the counters of the threads that exited with the shards of the running ones.
+inline std::vector<HandlerProfile> EventManager::handlerProfiles() const
+{
+    std::unordered_map<size_t, HandlerProfile> merged;
+    {
+        std::lock_guard<std::mutex> lock(profilesMutex);
+        merged = profilesById;
+        for (ProfileShard *shard : profileShards)
+        {
+            std::lock_guard<std::mutex> shardLock(shard->mutex);
+            for (const auto &idProfile : shard->profilesById)
+                addProfile(merged[idProfile.first], idProfile.second);
+        }
+    }
+    std::vector<HandlerProfile> profiles;
+    profiles.reserve(merged.size());
+    for (const auto &idProfile : merged)
+        profiles.push_back(idProfile.second);
+    std::sort(profiles.begin(), profiles.end(), [](const HandlerProfile &left, const HandlerProfile &right)
+              { return left.cycles > right.cycles; });
+    return profiles;
+}
+
+inline std::string EventManager::handlerProfileReport() const
+{
+    std::string report;
+    char line[256];
+    std::snprintf(line, sizeof(line), "%-32s %8s %12s %12s %12s %6s %12s %12s\n", "event", "id", "calls", "cycles/call",
+                  "instr/call", "IPC", "cmiss/call", "bmiss/call");
+    report += line;
+    for (const HandlerProfile &profile : handlerProfiles())
+    {
+        double calls = static_cast<double>(profile.calls);
+        double ipc = profile.cycles != 0 ? static_cast<double>(profile.instructions) / profile.cycles : 0.0;
+        std::snprintf(line, sizeof(line), "%-32s %8zu %12llu %12.0f %12.0f %6.2f %12.1f %12.1f\n", profile.eventName.c_str(),
+                      profile.functionId, static_cast<unsigned long long>(profile.calls), profile.cycles / calls,
+                      profile.instructions / calls, ipc, profile.cacheMisses / calls, profile.branchMisses / calls);
+        report += line;
+    }
+    return report;
+}
+
+inline void EventManager::clearHandlerProfiles()
+{
+    std::lock_guard<std::mutex> lock(profilesMutex);
+    profilesById.clear();
+    for (ProfileShard *shard : profileShards)
+    {
+        std::lock_guard<std::mutex> shardLock(shard->mutex);
+        shard->profilesById.clear();
+    }
+}
+
+inline void EventManager::addProfile(HandlerProfile &total, const HandlerProfile &profile)
+{
+    if (total.calls == 0)
+    {
+        total.eventName = profile.eventName;
+        total.functionId = profile.functionId;
+    }
+    total.calls += profile.calls;
+    total.cycles += profile.cycles;
+    total.instructions += profile.instructions;
+    total.cacheMisses += profile.cacheMisses;
+    total.branchMisses += profile.branchMisses;
+}
+
+inline EventManager::ProfileShard &EventManager::localProfileShard()
+{
+    // Owns the shard of the thread, and merges what it counted into profilesById when the thread exits.
+    struct Registration
+    {
+        EventManager &manager;
+        ProfileShard *shard = new ProfileShard;
+
+        explicit Registration(EventManager &manager) : manager(manager)
+        {
+            std::lock_guard<std::mutex> lock(manager.profilesMutex);
+            manager.profileShards.push_back(shard);
+        }
+
+        ~Registration()
+        {
+            std::lock_guard<std::mutex> lock(manager.profilesMutex);
+            auto &shards = manager.profileShards;
+            shards.erase(std::find(shards.begin(), shards.end(), shard));
+            for (const auto &idProfile : shard->profilesById)
+                addProfile(manager.profilesById[idProfile.first], idProfile.second);
+            delete shard;
+        }
+    };
+
+    thread_local Registration registration(*this);
+    return *registration.shard;
+}
+
+inline const EventManager::HardwareCounters &EventManager::threadHardwareCounters()
+{
+    thread_local HardwareCounters counters;
+    return counters;
+}
+
+#ifdef __linux__
+// Open the four counters as one group led by the cycle counter, counting this thread in user space on any CPU.
+inline EventManager::HardwareCounters::HardwareCounters()
+{
+    const uint64_t configs[kCount] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+                                      PERF_COUNT_HW_BRANCH_MISSES};
+    for (size_t counter = 0; counter < kCount; ++counter)
+    {
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[counter];
+        attr.disabled = counter == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        fds[counter] = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, counter == 0 ? -1 : fds[0], PERF_FLAG_FD_CLOEXEC));
+        if (fds[counter] < 0)
+            return;
+    }
+    available = ::ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) == 0;
+}
+
+inline EventManager::HardwareCounters::~HardwareCounters()
+{
+    for (int fd : fds)
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+}
+
+inline bool EventManager::HardwareCounters::read(uint64_t (&values)[kCount]) const
+{
+    if (!available)
+        return false;
+    // PERF_FORMAT_GROUP layout: the number of counters, then their values in the order they were opened.
+    uint64_t group[1 + kCount];
+    if (::read(fds[0], group, sizeof(group)) != static_cast<ssize_t>(sizeof(group)))
+        return false;
+    for (size_t counter = 0; counter < kCount; ++counter)
+        values[counter] = group[1 + counter];
+    return true;
+}
+#else
+inline EventManager::HardwareCounters::HardwareCounters() = default;
+inline EventManager::HardwareCounters::~HardwareCounters() = default;
+
+inline bool EventManager::HardwareCounters::read(uint64_t (&)[kCount]) const
+{
+    return false;
+}
+#endif
+
+#ifdef __linux__
+// Create the eventfd on first use. If events are already pending it starts out readable.
+inline int EventManager::pendingEventFd()
+{
+    std::lock_guard<std::mutex> fdLock(pendingFdMutex);
+    int fd = pendingFd.load(std::memory_order_acquire);
+    if (fd < 0)
+    {
+        fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0)
+            return -1;
+        pendingFd.store(fd, std::memory_order_release);
+
+        std::lock_guard<std::mutex> lock(pendingEventsMutex);
+        if (pendingCount != 0 && !pendingSignalled.exchange(true))
         {
-            funcPair.second(args...);
+            uint64_t one = 1;
+            while (::write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+            {
+            }
         }
     }
+    return fd;
 }
+#endif
 
 #endif // EVENT_MANAGER_H
\ No newline at end of file
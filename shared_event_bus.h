@@ -0,0 +1,559 @@
+// shared_event_bus.h
+
+// The SharedEventBus class publishes events into a POSIX shared-memory ring so that other processes on the same host
+// can receive them with the same on<Args...>(name, fn) API as EventManager, without serializing through sockets.
+// The ring is multi-producer and multi-consumer: every process that opens the bus can emit, and every process sees
+// every event published after it opened the bus (broadcast, not work-sharing). Slots are cache-line aligned so that
+// producers writing neighbouring slots do not invalidate each other's lines.
+//
+// Payload arguments must be trivially copyable or have an EventCodec specialization. A codec for std::string is
+// provided. Argument types are decayed, so on<const std::string &, int> receives what emitEvent<std::string, int>
+// published.
+//
+// Example usage:
+//     // Control process
+//     SharedEventBus bus("/mixer_bus");
+//     bus.emitEvent<std::string, unsigned int, int>("set_volume", "input", 3u, -12);
+//
+//     // Audio process
+//     SharedEventBus bus("/mixer_bus");
+//     bus.on<const std::string &, unsigned int, int>("set_volume", [this](const std::string &channel_type, unsigned int channel_number, int volume_db)
+//                                                    { this->setVolume(channel_type, channel_number, volume_db); });
+//     while (running)
+//         bus.poll();
+//
+//  Events already registered on an EventManager can be forwarded by subscribing a handler that calls bus.emitEvent().
+//  A consumer that falls more than one ring length behind loses the overwritten events; droppedEvents() counts them.
+//
+//  Any process attached to the bus may die at any point, so no wait on another process is unbounded:
+//  - A producer that claimed a slot and did not publish it within kPublishTimeout is presumed dead. Consumers skip the
+//    slot and count it in staleEvents(), and the producer of the next lap takes the slot over. A producer that was only
+//    stalled that long finds its slot taken when it resumes and emitEvent() returns false; the writes it made after
+//    resuming may tear the event of the producer that took the slot over, so the timeout is far above any stall of a
+//    live producer.
+//  - Opening a bus whose creator died before initializing it throws std::system_error (ETIMEDOUT) after
+//    kAttachTimeout. The segment must then be removed with unlink() and created again.
+//  Functions are called by poll() without any lock held, so they may call on() and off() on the same bus.
+
+#ifndef SHARED_EVENT_BUS_H
+#define SHARED_EVENT_BUS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Encodes and decodes a payload argument into a shared-memory slot.
+// Specialize this template for types that are not trivially copyable. encode() stores the number of bytes written
+// and returns false if the value does not fit into capacity bytes. decode() receives exactly the bytes that encode()
+// wrote and returns false if they do not describe a valid value.
+template <typename T, typename Enable = void>
+struct EventCodec
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "SharedEventBus payloads must be trivially copyable or provide an EventCodec specialization");
+
+    static bool encode(const T &value, unsigned char *out, size_t capacity, size_t &written)
+    {
+        if (capacity < sizeof(T))
+            return false;
+        std::memcpy(out, &value, sizeof(T));
+        written = sizeof(T);
+        return true;
+    }
+
+    static bool decode(const unsigned char *in, size_t size, T &value)
+    {
+        if (size != sizeof(T))
+            return false;
+        std::memcpy(&value, in, sizeof(T));
+        return true;
+    }
+};
+
+// Codec for std::string payloads, stored as raw characters.
+template <>
+struct EventCodec<std::string>
+{
+    static bool encode(const std::string &value, unsigned char *out, size_t capacity, size_t &written)
+    {
+        if (capacity < value.size())
+            return false;
+        std::memcpy(out, value.data(), value.size());
+        written = value.size();
+        return true;
+    }
+
+    static bool decode(const unsigned char *in, size_t size, std::string &value)
+    {
+        value.assign(reinterpret_cast<const char *>(in), size);
+        return true;
+    }
+};
+
+// String literals are published with the same encoding as std::string, so subscribers use std::string.
+template <>
+struct EventCodec<const char *>
+{
+    static bool encode(const char *value, unsigned char *out, size_t capacity, size_t &written)
+    {
+        size_t size = std::strlen(value);
+        if (capacity < size)
+            return false;
+        std::memcpy(out, value, size);
+        written = size;
+        return true;
+    }
+};
+
+class SharedEventBus
+{
+public:
+    static constexpr size_t kCacheLineSize = 64;
+    static constexpr size_t kSlotSize = 512;
+    static constexpr size_t kMaxEventNameLength = 63;
+    // How long a claimed slot may stay unpublished before its producer is presumed dead.
+    static constexpr std::chrono::milliseconds kPublishTimeout{100};
+    // How long opening a bus waits for the process that created it to initialize it.
+    static constexpr std::chrono::milliseconds kAttachTimeout{1000};
+
+    // Open (or create) the shared-memory bus with the given POSIX shm name, e.g. "/mixer_bus".
+    // slotCount is rounded up to a power of two and is only used by the process that creates the segment.
+    explicit SharedEventBus(const std::string &shmName, size_t slotCount = 4096);
+    ~SharedEventBus();
+
+    SharedEventBus(const SharedEventBus &) = delete;
+    SharedEventBus &operator=(const SharedEventBus &) = delete;
+
+    // Remove the shared-memory segment name. Processes that already mapped it keep working.
+    static void unlink(const std::string &shmName) { ::shm_unlink(shmName.c_str()); }
+
+    // Register a function or lambda function with a specific event name.
+    template <typename... Args, typename F>
+    size_t on(std::string eventName, F &&newFunc);
+
+    // Unregister a function previously registered with on().
+    void off(std::string eventName, size_t id);
+
+    // Publish an event with the specified name and arguments to every process attached to the bus.
+    // Returns false if the event name or encoded payload does not fit into a slot, or if the slot was taken over because
+    // this producer stalled for longer than kPublishTimeout.
+    template <typename... Args>
+    bool emitEvent(std::string eventName, Args... args);
+
+    // Dispatch every event published since the last call to the locally registered functions.
+    // Returns the number of events read from the ring.
+    size_t poll();
+
+    // Number of events this process missed because the producers lapped it.
+    uint64_t droppedEvents() const { return dropped; }
+
+    // Number of events whose payload did not decode into the registered argument types.
+    uint64_t mismatchedEvents() const { return mismatched; }
+
+    // Number of slots this process skipped because their producer did not publish them within kPublishTimeout.
+    uint64_t staleEvents() const { return stale; }
+
+private:
+    // Lets tests put the ring into states that only a producer dying mid-publish leaves behind.
+    friend struct SharedEventBusTestAccess;
+
+    static constexpr uint64_t kMagic = 0x45564e5442555331ULL; // "EVNTBUS1"
+    static constexpr uint32_t kVersion = 1;
+
+    struct alignas(kCacheLineSize) Slot
+    {
+        // 2 * ticket + 1 while the producer of ticket is writing, 2 * ticket + 2 once it is published.
+        std::atomic<uint64_t> sequence;
+        uint32_t nameLength;
+        uint32_t payloadSize;
+        char name[kMaxEventNameLength + 1];
+        unsigned char payload[kSlotSize - kCacheLineSize - (kMaxEventNameLength + 1)];
+    };
+    static_assert(sizeof(Slot) == kSlotSize, "Slot must be exactly kSlotSize bytes");
+
+    struct Header
+    {
+        std::atomic<uint64_t> magic;
+        uint32_t version;
+        uint32_t slotSize;
+        uint64_t slotCount;
+        alignas(kCacheLineSize) std::atomic<uint64_t> writeCursor;
+        alignas(kCacheLineSize) unsigned char padding[kCacheLineSize];
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "SharedEventBus requires lock-free 64-bit atomics");
+
+    using Decoder = std::function<void(const unsigned char *, size_t)>;
+    // The decoders of one event name. Replaced as a whole by on() and off(), so poll() can call them without the lock.
+    using Decoders = std::vector<std::pair<size_t, Decoder>>;
+
+    template <typename T>
+    using Decayed = typename std::decay<T>::type;
+
+    Slot &slotAt(uint64_t ticket) { return slots[ticket & (header->slotCount - 1)]; }
+
+    template <typename T>
+    static bool encodeArgument(const T &value, unsigned char *&out, size_t &capacity);
+
+    template <typename T>
+    static bool decodeArgument(const unsigned char *&in, size_t &size, T &value);
+
+    void dispatch(const std::string &eventName, const unsigned char *payload, size_t size);
+
+    int fd = -1;
+    size_t mappedSize = 0;
+    Header *header = nullptr;
+    Slot *slots = nullptr;
+    uint64_t readCursor = 0;
+    uint64_t dropped = 0;
+    uint64_t mismatched = 0;
+    uint64_t stale = 0;
+    size_t nextId = 0;
+    // Time since which poll() has found the slot at readCursor claimed but unpublished, or zero.
+    std::chrono::steady_clock::time_point stalledSince{};
+
+    // Locally registered decoders. Each one unpacks the payload for its own Args... and calls the user function.
+    std::map<std::string, std::shared_ptr<const Decoders>> decodersMap;
+    std::mutex decodersMapMutex;
+};
+
+inline SharedEventBus::SharedEventBus(const std::string &shmName, size_t slotCount)
+{
+    size_t roundedSlotCount = 1;
+    while (roundedSlotCount < slotCount)
+        roundedSlotCount <<= 1;
+
+    bool created = true;
+    fd = ::shm_open(shmName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0660);
+    if (fd < 0 && errno == EEXIST)
+    {
+        created = false;
+        fd = ::shm_open(shmName.c_str(), O_RDWR, 0660);
+    }
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "shm_open " + shmName);
+
+    if (created)
+    {
+        mappedSize = sizeof(Header) + roundedSlotCount * sizeof(Slot);
+        if (::ftruncate(fd, static_cast<off_t>(mappedSize)) != 0)
+        {
+            int error = errno;
+            ::close(fd);
+            ::shm_unlink(shmName.c_str());
+            throw std::system_error(error, std::generic_category(), "ftruncate " + shmName);
+        }
+    }
+    else
+    {
+        // Wait until the creator has sized the segment.
+        auto deadline = std::chrono::steady_clock::now() + kAttachTimeout;
+        struct stat status;
+        do
+        {
+            if (::fstat(fd, &status) != 0)
+            {
+                int error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), "fstat " + shmName);
+            }
+            if (static_cast<size_t>(status.st_size) < sizeof(Header))
+            {
+                if (std::chrono::steady_clock::now() >= deadline)
+                {
+                    ::close(fd);
+                    throw std::system_error(ETIMEDOUT, std::generic_category(), "shared event bus was not created " + shmName);
+                }
+                std::this_thread::yield();
+            }
+        } while (static_cast<size_t>(status.st_size) < sizeof(Header));
+        mappedSize = static_cast<size_t>(status.st_size);
+    }
+
+    void *memory = ::mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED)
+    {
+        int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), "mmap " + shmName);
+    }
+    header = static_cast<Header *>(memory);
+    slots = reinterpret_cast<Slot *>(static_cast<unsigned char *>(memory) + sizeof(Header));
+
+    if (created)
+    {
+        // ftruncate zero-fills the segment, so every slot sequence already starts at 0 (empty).
+        header->version = kVersion;
+        header->slotSize = kSlotSize;
+        header->slotCount = roundedSlotCount;
+        header->writeCursor.store(0, std::memory_order_relaxed);
+        header->magic.store(kMagic, std::memory_order_release);
+    }
+    else
+    {
+        auto deadline = std::chrono::steady_clock::now() + kAttachTimeout;
+        while (header->magic.load(std::memory_order_acquire) != kMagic)
+        {
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                ::munmap(memory, mappedSize);
+                ::close(fd);
+                throw std::system_error(ETIMEDOUT, std::generic_category(), "shared event bus was not initialized " + shmName);
+            }
+            std::this_thread::yield();
+        }
+        if (header->version != kVersion || header->slotSize != kSlotSize ||
+            sizeof(Header) + header->slotCount * sizeof(Slot) > mappedSize)
+        {
+            ::munmap(memory, mappedSize);
+            ::close(fd);
+            throw std::system_error(EINVAL, std::generic_category(), "incompatible shared event bus " + shmName);
+        }
+    }
+
+    // Only events published after attaching are delivered.
+    readCursor = header->writeCursor.load(std::memory_order_acquire);
+}
+
+inline SharedEventBus::~SharedEventBus()
+{
+    if (header != nullptr)
+        ::munmap(header, mappedSize);
+    if (fd >= 0)
+        ::close(fd);
+}
+
+template <typename T>
+bool SharedEventBus::encodeArgument(const T &value, unsigned char *&out, size_t &capacity)
+{
+    // Each argument is prefixed with its encoded length so that decoders can walk the payload.
+    if (capacity < sizeof(uint32_t))
+        return false;
+    size_t written = 0;
+    if (!EventCodec<T>::encode(value, out + sizeof(uint32_t), capacity - sizeof(uint32_t), written))
+        return false;
+    uint32_t length = static_cast<uint32_t>(written);
+    std::memcpy(out, &length, sizeof(length));
+    out += sizeof(uint32_t) + written;
+    capacity -= sizeof(uint32_t) + written;
+    return true;
+}
+
+template <typename T>
+bool SharedEventBus::decodeArgument(const unsigned char *&in, size_t &size, T &value)
+{
+    uint32_t length;
+    if (size < sizeof(length))
+        return false;
+    std::memcpy(&length, in, sizeof(length));
+    if (size - sizeof(length) < length)
+        return false;
+    if (!EventCodec<T>::decode(in + sizeof(length), length, value))
+        return false;
+    in += sizeof(length) + length;
+    size -= sizeof(length) + length;
+    return true;
+}
+
+// Register a function or lambda function with a specific event name.
+template <typename... Args, typename F>
+size_t SharedEventBus::on(std::string eventName, F &&newFunc)
+{
+    std::function<void(Args...)> func = std::forward<F>(newFunc);
+    Decoder decoder = [this, func](const unsigned char *payload, size_t size)
+    {
+        std::tuple<Decayed<Args>...> values;
+        bool decoded = std::apply([&](auto &...value)
+                                  { return (decodeArgument(payload, size, value) && ...); },
+                                  values);
+        if (!decoded || size != 0)
+        {
+            ++mismatched;
+            return;
+        }
+        std::apply(func, values);
+    };
+
+    std::lock_guard<std::mutex> lock(decodersMapMutex);
+    size_t id = nextId++;
+    std::shared_ptr<const Decoders> &decoders = decodersMap[eventName];
+    auto updated = decoders != nullptr ? std::make_shared<Decoders>(*decoders) : std::make_shared<Decoders>();
+    updated->emplace_back(id, std::move(decoder));
+    decoders = std::move(updated);
+    return id;
+}
+
+// Method to remove a function with a specific event name and function ID.
+inline void SharedEventBus::off(std::string eventName, size_t id)
+{
+    std::lock_guard<std::mutex> lock(decodersMapMutex);
+    auto itr = decodersMap.find(eventName);
+
+    if (itr != decodersMap.end())
+    {
+        auto decoders = std::make_shared<Decoders>(*itr->second);
+        decoders->erase(std::remove_if(decoders->begin(), decoders->end(),
+                                       [&](const std::pair<size_t, Decoder> &pair)
+                                       { return pair.first == id; }),
+                        decoders->end());
+        if (decoders->empty())
+            decodersMap.erase(itr);
+        else
+            itr->second = std::move(decoders);
+    }
+}
+
+// Publish an event with the specified name and arguments to every process attached to the bus.
+template <typename... Args>
+bool SharedEventBus::emitEvent(std::string eventName, Args... args)
+{
+    if (eventName.size() > kMaxEventNameLength)
+        return false;
+
+    // Encode outside the slot so that a payload that does not fit never claims a ticket.
+    unsigned char payload[sizeof(Slot::payload)];
+    unsigned char *out = payload;
+    size_t capacity = sizeof(payload);
+    if (!(encodeArgument<Decayed<Args>>(args, out, capacity) && ...))
+        return false;
+    size_t payloadSize = sizeof(payload) - capacity;
+
+    uint64_t ticket = header->writeCursor.fetch_add(1, std::memory_order_acq_rel);
+    Slot &slot = slotAt(ticket);
+
+    // Wait for the producer of the previous lap on this slot to finish, so two live producers never write one slot at
+    // once. A producer that has not finished within kPublishTimeout is presumed dead and its slot is taken over. The
+    // slot is claimed with a compare-exchange, so a producer of a later lap that took it over from this one wins.
+    uint64_t previousLap = ticket >= header->slotCount ? 2 * (ticket - header->slotCount) + 2 : 0;
+    uint64_t claimed = 2 * ticket + 1;
+    uint64_t observed = slot.sequence.load(std::memory_order_acquire);
+    std::chrono::steady_clock::time_point deadline{};
+    for (;;)
+    {
+        if (observed > 2 * ticket)
+            return false;
+        if (observed < previousLap)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (deadline == std::chrono::steady_clock::time_point{})
+                deadline = now + kPublishTimeout;
+            if (now < deadline)
+            {
+                std::this_thread::yield();
+                observed = slot.sequence.load(std::memory_order_acquire);
+                continue;
+            }
+        }
+        if (slot.sequence.compare_exchange_weak(observed, claimed, std::memory_order_acquire, std::memory_order_acquire))
+            break;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.nameLength = static_cast<uint32_t>(eventName.size());
+    slot.payloadSize = static_cast<uint32_t>(payloadSize);
+    std::memcpy(slot.name, eventName.data(), eventName.size());
+    std::memcpy(slot.payload, payload, payloadSize);
+    // Fails if this producer stalled past kPublishTimeout and the slot was taken over meanwhile.
+    return slot.sequence.compare_exchange_strong(claimed, 2 * ticket + 2, std::memory_order_release,
+                                                 std::memory_order_relaxed);
+}
+
+// Dispatch every event published since the last call to the locally registered functions.
+inline size_t SharedEventBus::poll()
+{
+    size_t count = 0;
+    unsigned char payload[sizeof(Slot::payload)];
+
+    for (;;)
+    {
+        Slot &slot = slotAt(readCursor);
+        uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        uint64_t expected = 2 * readCursor + 2;
+
+        if (sequence < expected)
+        {
+            // Nothing was published yet, or the slot was claimed and its producer has not finished. A producer that
+            // does not finish within kPublishTimeout is presumed dead, and its slot is skipped.
+            if (header->writeCursor.load(std::memory_order_acquire) <= readCursor)
+                break;
+            auto now = std::chrono::steady_clock::now();
+            if (stalledSince == std::chrono::steady_clock::time_point{})
+                stalledSince = now;
+            if (now - stalledSince < kPublishTimeout)
+                break;
+            stalledSince = {};
+            ++stale;
+            ++readCursor;
+            continue;
+        }
+        stalledSince = {};
+
+        if (sequence == expected)
+        {
+            // Seqlock-style read: copy, then confirm the slot was not overwritten while copying.
+            uint32_t nameLength = slot.nameLength;
+            uint32_t payloadSize = slot.payloadSize;
+            if (nameLength <= kMaxEventNameLength && payloadSize <= sizeof(payload))
+            {
+                std::string eventName(slot.name, nameLength);
+                std::memcpy(payload, slot.payload, payloadSize);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.sequence.load(std::memory_order_relaxed) == expected)
+                {
+                    ++readCursor;
+                    ++count;
+                    dispatch(eventName, payload, payloadSize);
+                    continue;
+                }
+            }
+        }
+
+        // The producers lapped this consumer. Skip to the oldest event that is still in the ring.
+        uint64_t writeCursor = header->writeCursor.load(std::memory_order_acquire);
+        uint64_t oldest = writeCursor > header->slotCount ? writeCursor - header->slotCount + 1 : 0;
+        uint64_t resume = oldest > readCursor + 1 ? oldest : readCursor + 1;
+        dropped += resume - readCursor;
+        readCursor = resume;
+    }
+
+    return count;
+}
+
+// The decoders are taken under the lock and called without it, so they may call on() and off().
+inline void SharedEventBus::dispatch(const std::string &eventName, const unsigned char *payload, size_t size)
+{
+    std::shared_ptr<const Decoders> decoders;
+    {
+        std::lock_guard<std::mutex> lock(decodersMapMutex);
+        auto itr = decodersMap.find(eventName);
+        if (itr == decodersMap.end())
+            return;
+        decoders = itr->second;
+    }
+
+    // Execute all registered functions with the decoded arguments.
+    for (const auto &decoderPair : *decoders)
+    {
+        decoderPair.second(payload, size);
+    }
+}
+
+#endif // SHARED_EVENT_BUS_H
@@ -0,0 +1,179 @@
+// Stress test of on(), once(), off() and emitEvent() running concurrently on a few events, which are created and
+// reclaimed over and over as their functions come and go. Every operation is bracketed by ticks of a global clock, and
+// every function records the emits that called it. Afterwards each call is checked against the intervals:
+//  - a function is only called by emits of its event that started before its off() returned and ended after its on()
+//    started;
+//  - an emit that ran entirely between the return of on() and the start of off() called the function;
+//  - no emit called a function twice, and no once() function was called more than once.
+//
+//     make check, or ./registration_stress [milliseconds]
+
+#include "event_manager.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace
+{
+
+constexpr int kEvents = 4;
+constexpr int kRegistrars = 3;
+constexpr int kEmitters = 3;
+
+std::atomic<uint64_t> globalClock{0};
+
+uint64_t tick() { return globalClock.fetch_add(1, std::memory_order_seq_cst); }
+
+std::string eventName(int event) { return "stress" + std::to_string(event); }
+
+struct FunctionRecord
+{
+    int event = 0;
+    bool once = false;
+    uint64_t beforeOn = 0;
+    uint64_t afterOn = 0;
+    uint64_t beforeOff = 0;
+    uint64_t afterOff = 0;
+    std::mutex mutex;
+    std::vector<uint64_t> emits;
+};
+
+struct EmitRecord
+{
+    uint64_t id;
+    int event;
+    uint64_t start;
+    uint64_t end;
+};
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    std::chrono::milliseconds duration(argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000);
+    EventManager &eventManager = EventManager::getInstance();
+
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> nextEmit{0};
+    std::vector<std::deque<FunctionRecord>> functions(kRegistrars);
+    std::vector<std::vector<EmitRecord>> emits(kEmitters);
+    std::vector<std::thread> threads;
+
+    for (int registrar = 0; registrar < kRegistrars; ++registrar)
+    {
+        threads.emplace_back([&, registrar]()
+                             {
+                                 std::deque<FunctionRecord> &records = functions[registrar];
+                                 for (uint64_t round = 0; !stop.load(std::memory_order_relaxed); ++round)
+                                 {
+                                     records.emplace_back();
+                                     FunctionRecord &record = records.back();
+                                     record.event = static_cast<int>((round + registrar) % kEvents);
+                                     record.once = round % 5 == 0;
+                                     auto function = [&record](uint64_t emit)
+                                     {
+                                         std::lock_guard<std::mutex> lock(record.mutex);
+                                         record.emits.push_back(emit);
+                                     };
+                                     record.beforeOn = tick();
+                                     size_t id = record.once ? eventManager.once<uint64_t>(eventName(record.event), function)
+                                                             : eventManager.on<uint64_t>(eventName(record.event), function);
+                                     record.afterOn = tick();
+                                     std::this_thread::yield();
+                                     record.beforeOff = tick();
+                                     eventManager.off<uint64_t>(eventName(record.event), id);
+                                     record.afterOff = tick();
+                                 } });
+    }
+    for (int emitter = 0; emitter < kEmitters; ++emitter)
+    {
+        threads.emplace_back([&, emitter]()
+                             {
+                                 for (uint64_t round = 0; !stop.load(std::memory_order_relaxed); ++round)
+                                 {
+                                     EmitRecord record;
+                                     record.id = nextEmit.fetch_add(1, std::memory_order_relaxed);
+                                     record.event = static_cast<int>((round + emitter) % kEvents);
+                                     record.start = tick();
+                                     eventManager.emitEvent<uint64_t>(eventName(record.event), record.id);
+                                     record.end = tick();
+                                     emits[emitter].push_back(record);
+                                 } });
+    }
+    std::this_thread::sleep_for(duration);
+    stop.store(true, std::memory_order_relaxed);
+    for (std::thread &thread : threads)
+        thread.join();
+
+    std::unordered_map<uint64_t, EmitRecord> emitsById;
+    std::vector<std::vector<EmitRecord>> emitsByEvent(kEvents);
+    for (const auto &emitterEmits : emits)
+    {
+        for (const EmitRecord &record : emitterEmits)
+        {
+            emitsById.emplace(record.id, record);
+            emitsByEvent[record.event].push_back(record);
+        }
+    }
+    for (auto &eventEmits : emitsByEvent)
+    {
+        std::sort(eventEmits.begin(), eventEmits.end(), [](const EmitRecord &left, const EmitRecord &right)
+                  { return left.start < right.start; });
+    }
+
+    size_t registered = 0;
+    size_t calls = 0;
+    size_t failures = 0;
+    auto fail = [&failures](const char *what, const FunctionRecord &function)
+    {
+        if (++failures <= 10)
+        {
+            std::fprintf(stderr, "FAIL: %s (event %d, on %llu-%llu, off %llu-%llu)\n", what, function.event,
+                         static_cast<unsigned long long>(function.beforeOn), static_cast<unsigned long long>(function.afterOn),
+                         static_cast<unsigned long long>(function.beforeOff), static_cast<unsigned long long>(function.afterOff));
+        }
+    };
+    for (const auto &registrarFunctions : functions)
+    {
+        for (const FunctionRecord &function : registrarFunctions)
+        {
+            ++registered;
+            calls += function.emits.size();
+            std::unordered_set<uint64_t> callers;
+            for (uint64_t emit : function.emits)
+            {
+                const EmitRecord &record = emitsById.at(emit);
+                if (record.event != function.event)
+                    fail("called by an emit of another event", function);
+                if (record.end < function.beforeOn || record.start > function.afterOff)
+                    fail("called outside its registration", function);
+                if (!callers.insert(emit).second)
+                    fail("called twice by one emit", function);
+            }
+            if (function.once && function.emits.size() > 1)
+                fail("once() function called more than once", function);
+            if (function.once && !function.emits.empty())
+                continue;
+            const std::vector<EmitRecord> &eventEmits = emitsByEvent[function.event];
+            auto first = std::upper_bound(eventEmits.begin(), eventEmits.end(), function.afterOn,
+                                          [](uint64_t time, const EmitRecord &record)
+                                          { return time < record.start; });
+            for (auto record = first; record != eventEmits.end() && record->start < function.beforeOff; ++record)
+            {
+                if (record->end < function.beforeOff && callers.count(record->id) == 0)
+                    fail("not called by an emit during its registration", function);
+            }
+        }
+    }
+
+    std::printf("%zu functions, %zu emits, %zu calls, %zu failures\n", registered, emitsById.size(), calls, failures);
+    return failures == 0 ? 0 : 1;
+}
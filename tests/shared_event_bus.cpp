@@ -0,0 +1,178 @@
+// Tests of SharedEventBus across processes: a round trip between a parent and a forked child, a consumer lapped by a
+// small ring, and a producer killed between claiming a slot and publishing it.
+//
+//     make check, or ./shared_event_bus
+
+#include "shared_event_bus.h"
+
+#include <csignal>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Claims a ticket the way emitEvent() does and returns without publishing it, like a producer that died right there.
+struct SharedEventBusTestAccess
+{
+    static uint64_t claim(SharedEventBus &bus)
+    {
+        uint64_t ticket = bus.header->writeCursor.fetch_add(1, std::memory_order_acq_rel);
+        bus.slotAt(ticket).sequence.store(2 * ticket + 1, std::memory_order_release);
+        return ticket;
+    }
+};
+
+namespace
+{
+
+int failures = 0;
+
+void check(bool condition, const char *what)
+{
+    if (!condition)
+    {
+        std::fprintf(stderr, "FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+std::string busName(const char *test) { return "/event_bus_test_" + std::string(test) + "_" + std::to_string(::getpid()); }
+
+// Poll until count events were dispatched or a second has passed.
+void pollFor(SharedEventBus &bus, size_t count, const size_t &received)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (received < count && std::chrono::steady_clock::now() < deadline)
+    {
+        if (bus.poll() == 0)
+            std::this_thread::yield();
+    }
+}
+
+// The parent publishes to a child that attached after fork(), and the child answers with what it received. The ring
+// holds the whole burst, so the child is never lapped.
+void testRoundTrip()
+{
+    std::string name = busName("round_trip");
+    SharedEventBus::unlink(name);
+    SharedEventBus bus(name, 128);
+    size_t acknowledged = 0;
+    long acknowledgedSum = -1;
+    bus.on<size_t, long>("ack", [&](size_t count, long sum)
+                         { ++acknowledged; acknowledgedSum = count == 100 ? sum : -1; });
+
+    int ready[2];
+    check(::pipe(ready) == 0, "pipe");
+    pid_t child = ::fork();
+    if (child == 0)
+    {
+        SharedEventBus childBus(name);
+        size_t received = 0;
+        long sum = 0;
+        bool ordered = true;
+        childBus.on<const std::string &, int>("message", [&](const std::string &text, int value)
+                                              {
+                                                  ordered = ordered && value == static_cast<int>(received) &&
+                                                            text == "value " + std::to_string(value);
+                                                  ++received;
+                                                  sum += value; });
+        char byte = 1;
+        if (::write(ready[1], &byte, 1) != 1)
+            ::_exit(2);
+        pollFor(childBus, 100, received);
+        childBus.emitEvent<size_t, long>("ack", received, ordered ? sum : -1);
+        ::_exit(0);
+    }
+
+    char byte = 0;
+    check(::read(ready[0], &byte, 1) == 1, "child attached");
+    for (int value = 0; value < 100; ++value)
+        check(bus.emitEvent<std::string, int>("message", "value " + std::to_string(value), value), "emit to the child");
+    pollFor(bus, 1, acknowledged);
+    int status = 0;
+    ::waitpid(child, &status, 0);
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "child exited cleanly");
+    check(acknowledged == 1 && acknowledgedSum == 99 * 100 / 2, "child received every event in order");
+    ::close(ready[0]);
+    ::close(ready[1]);
+    SharedEventBus::unlink(name);
+}
+
+// A consumer that does not poll while 20 events go through a ring of 8 receives only the newest ones, in order, and
+// counts the rest as dropped.
+void testLappedConsumer()
+{
+    std::string name = busName("lapped");
+    SharedEventBus::unlink(name);
+    SharedEventBus producer(name, 8);
+    SharedEventBus consumer(name);
+    std::vector<int> received;
+    consumer.on<int>("tick", [&](int value)
+                     { received.push_back(value); });
+
+    for (int value = 0; value < 20; ++value)
+        check(producer.emitEvent<int>("tick", value), "emit into a small ring");
+    consumer.poll();
+
+    check(!received.empty() && received.size() <= 8, "lapped consumer receives at most a ring of events");
+    check(received.size() + consumer.droppedEvents() == 20, "every event is either received or dropped");
+    for (size_t index = 0; index < received.size(); ++index)
+        check(received[index] == static_cast<int>(20 - received.size() + index), "newest events in order");
+    SharedEventBus::unlink(name);
+}
+
+// A producer killed after claiming a slot leaves it unpublished. The consumer waits kPublishTimeout, skips it and counts
+// it as stale, and the producer whose ticket lands on that slot a lap later takes it over.
+void testKilledProducer()
+{
+    std::string name = busName("killed");
+    SharedEventBus::unlink(name);
+    SharedEventBus producer(name, 4);
+    SharedEventBus consumer(name);
+    std::vector<int> received;
+    consumer.on<int>("tick", [&](int value)
+                     { received.push_back(value); });
+
+    pid_t child = ::fork();
+    if (child == 0)
+    {
+        SharedEventBus childBus(name);
+        SharedEventBusTestAccess::claim(childBus);
+        ::raise(SIGKILL);
+    }
+    int status = 0;
+    ::waitpid(child, &status, 0);
+    check(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL, "producer killed mid-publish");
+
+    for (int value = 1; value <= 3; ++value)
+        check(producer.emitEvent<int>("tick", value), "emit behind the dead slot");
+    consumer.poll();
+    check(received.empty() && consumer.staleEvents() == 0, "consumer waits for the claimed slot");
+
+    std::this_thread::sleep_for(SharedEventBus::kPublishTimeout + std::chrono::milliseconds(20));
+    consumer.poll();
+    check(consumer.staleEvents() == 1, "dead slot counted as stale");
+    check((received == std::vector<int>{1, 2, 3}), "events behind the dead slot delivered");
+
+    // Ticket 4 lands on the dead slot, which the producer takes over once the timeout passed.
+    auto start = std::chrono::steady_clock::now();
+    check(producer.emitEvent<int>("tick", 4), "next lap takes the dead slot over");
+    check(std::chrono::steady_clock::now() - start >= SharedEventBus::kPublishTimeout, "takeover waits kPublishTimeout");
+    consumer.poll();
+    check((received == std::vector<int>{1, 2, 3, 4}), "taken-over slot delivered");
+    check(consumer.droppedEvents() == 0 && consumer.staleEvents() == 1, "no further losses");
+    SharedEventBus::unlink(name);
+}
+
+} // namespace
+
+int main()
+{
+    testRoundTrip();
+    testLappedConsumer();
+    testKilledProducer();
+    std::printf("%d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}